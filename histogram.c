@@ -0,0 +1,95 @@
+/**
+ * histogram.c - Log-linear bucketed histogram for latency measurements
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <string.h>
+#include <math.h>
+
+#include "histogram.h"
+
+void hist_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+	unsigned int i;
+
+	if (src->count == 0) {
+		return;
+	}
+
+	if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+	if (src->max > dst->max) dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (i=0; i < HIST_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+}
+
+/**
+ * Highest value that is recorded in a bucket
+ */
+static uint64_t bucket_max_value(unsigned int idx)
+{
+	if (idx < HIST_SUB_BUCKETS) {
+		return idx;
+	}
+
+	unsigned int shift = idx / (HIST_SUB_BUCKETS / 2) - 1;
+	uint64_t sub = idx - shift * (HIST_SUB_BUCKETS / 2);
+	return ((sub + 1) << shift) - 1;
+}
+
+uint64_t hist_percentile(const struct histogram *h, double percentile)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+
+	target = ceil(h->count * percentile / 100);
+	if (target == 0) target = 1;
+
+	for (i=0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) {
+			uint64_t value = bucket_max_value(i);
+			return (value < h->max) ? value : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+double hist_mean(const struct histogram *h)
+{
+	if (h->count == 0) {
+		return 0;
+	}
+	return (double) h->sum / h->count;
+}
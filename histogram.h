@@ -0,0 +1,86 @@
+/**
+ * histogram.h - Log-linear bucketed histogram for latency measurements
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+/**
+ * Histogram with logarithmic buckets that are linearly subdivided
+ *
+ * Every power of two range is split in HIST_SUB_BUCKETS / 2 buckets, so the
+ * relative error of a reported value is at most 2 / HIST_SUB_BUCKETS. Values
+ * below HIST_SUB_BUCKETS are recorded exactly. Recording is a few integer
+ * operations and never allocates memory.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) * (HIST_SUB_BUCKETS / 2))
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_reset(struct histogram *h);
+
+static inline unsigned int hist_bucket(uint64_t value)
+{
+	if (value < HIST_SUB_BUCKETS) {
+		return value;
+	}
+
+	unsigned int msb = 63 - __builtin_clzll(value);
+	unsigned int shift = msb - (HIST_SUB_BITS - 1);
+	return shift * (HIST_SUB_BUCKETS / 2) + (value >> shift);
+}
+
+static inline void hist_record(struct histogram *h, uint64_t value)
+{
+	h->buckets[hist_bucket(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min || h->count == 1) h->min = value;
+	if (value > h->max) h->max = value;
+}
+
+/**
+ * Add all values recorded in src to dst
+ */
+void hist_merge(struct histogram *dst, const struct histogram *src);
+
+/**
+ * Value below which the given percentage of recorded values fall
+ *
+ * Returns the highest value that falls in the same bucket, but never more
+ * than the maximum recorded value. Returns 0 for an empty histogram.
+ */
+uint64_t hist_percentile(const struct histogram *h, double percentile);
+
+double hist_mean(const struct histogram *h);
+
+#endif // __HISTOGRAM_H__
@@ -0,0 +1,436 @@
+/**
+ * prbs.c - Pseudo Random Binary Sequence generator and checker
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define WITH_X86_SIMD 1
+#endif
+
+#include "prbs.h"
+
+/**
+ * Sequence parameters
+ *
+ * A sequence with polynomial x^n + x^m + 1 satisfies b[i] = b[i-n] ^ b[i-m].
+ * Squaring the polynomial k times gives b[i] = b[i - n*2^k] ^ b[i - m*2^k].
+ * With k >= 3 both distances are whole bytes, so every byte of the stream is
+ * the XOR of two earlier bytes. k is chosen so that the nearest tap is at
+ * least 32 bytes away, which allows generating 32 bytes at a time.
+ */
+struct prbs_poly {
+	enum prbs_type type;
+	const char *name;
+	unsigned int n;  // Polynomial degree
+	unsigned int m;  // Polynomial middle tap
+	size_t dn;       // Byte distance of far tap
+	size_t dm;       // Byte distance of near tap
+};
+
+static const struct prbs_poly polys[] = {
+	{ PRBS7,  "prbs7",   7,  6, 56, 48 },
+	{ PRBS15, "prbs15", 15, 14, 60, 56 },
+	{ PRBS23, "prbs23", 23, 18, 46, 36 },
+	{ PRBS31, "prbs31", 31, 28, 62, 56 },
+};
+
+/**
+ * Implementation
+ *
+ * fill() generates buf[start..len), check() checks buf[start..len). Both
+ * require start >= dn.
+ */
+struct prbs_impl {
+	const char *name;
+	void (*fill)(uint8_t *buf, size_t start, size_t len, size_t dn, size_t dm);
+	uint64_t (*check)(const uint8_t *buf, size_t start, size_t len, size_t dn, size_t dm);
+};
+
+static const struct prbs_poly *get_poly(enum prbs_type type)
+{
+	size_t i;
+	for (i=0; i < sizeof(polys) / sizeof(polys[0]); i++) {
+		if (polys[i].type == type) {
+			return &polys[i];
+		}
+	}
+	return NULL;
+}
+
+//***** Scalar implementation *****//
+static void fill_scalar(uint8_t *buf, size_t start, size_t len,
+		size_t dn, size_t dm)
+{
+	size_t j = start;
+
+	// All taps are at least 8 bytes away
+	for (; j + 8 <= len; j += 8) {
+		uint64_t a, b;
+		memcpy(&a, &buf[j - dn], 8);
+		memcpy(&b, &buf[j - dm], 8);
+		a ^= b;
+		memcpy(&buf[j], &a, 8);
+	}
+	for (; j < len; j++) {
+		buf[j] = buf[j - dn] ^ buf[j - dm];
+	}
+}
+
+static uint64_t check_scalar(const uint8_t *buf, size_t start, size_t len,
+		size_t dn, size_t dm)
+{
+	uint64_t syndrome = 0;
+	size_t j = start;
+
+	for (; j + 8 <= len; j += 8) {
+		uint64_t a, b, c;
+		memcpy(&a, &buf[j], 8);
+		memcpy(&b, &buf[j - dn], 8);
+		memcpy(&c, &buf[j - dm], 8);
+		syndrome += __builtin_popcountll(a ^ b ^ c);
+	}
+	for (; j < len; j++) {
+		syndrome += __builtin_popcount(buf[j] ^ buf[j - dn] ^ buf[j - dm]);
+	}
+
+	return syndrome;
+}
+
+static const struct prbs_impl impl_scalar = {
+	"scalar", fill_scalar, check_scalar
+};
+
+#ifdef WITH_X86_SIMD
+//***** SSSE3 implementation *****//
+__attribute__((target("ssse3")))
+static void fill_ssse3(uint8_t *buf, size_t start, size_t len,
+		size_t dn, size_t dm)
+{
+	size_t j = start;
+
+	for (; j + 16 <= len; j += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) &buf[j - dn]);
+		__m128i b = _mm_loadu_si128((const __m128i *) &buf[j - dm]);
+		_mm_storeu_si128((__m128i *) &buf[j], _mm_xor_si128(a, b));
+	}
+	fill_scalar(buf, j, len, dn, dm);
+}
+
+__attribute__((target("ssse3")))
+static uint64_t check_ssse3(const uint8_t *buf, size_t start, size_t len,
+		size_t dn, size_t dm)
+{
+	const __m128i lut = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+					  1, 2, 2, 3, 2, 3, 3, 4);
+	const __m128i low_mask = _mm_set1_epi8(0x0f);
+	__m128i acc = _mm_setzero_si128();
+	size_t j = start;
+
+	for (; j + 16 <= len; j += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *) &buf[j]);
+		x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *) &buf[j - dn]));
+		x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *) &buf[j - dm]));
+
+		// Count bits per nibble with a lookup table
+		__m128i lo = _mm_and_si128(x, low_mask);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), low_mask);
+		__m128i cnt = _mm_add_epi8(_mm_shuffle_epi8(lut, lo),
+					   _mm_shuffle_epi8(lut, hi));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(cnt, _mm_setzero_si128()));
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *) lanes, acc);
+
+	return lanes[0] + lanes[1] + check_scalar(buf, j, len, dn, dm);
+}
+
+static const struct prbs_impl impl_ssse3 = {
+	"ssse3", fill_ssse3, check_ssse3
+};
+
+//***** AVX2 implementation *****//
+__attribute__((target("avx2")))
+static void fill_avx2(uint8_t *buf, size_t start, size_t len,
+		size_t dn, size_t dm)
+{
+	size_t j = start;
+
+	// Near tap is at least 32 bytes away, so the loads never overlap the
+	// store of the same iteration.
+	for (; j + 32 <= len; j += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) &buf[j - dn]);
+		__m256i b = _mm256_loadu_si256((const __m256i *) &buf[j - dm]);
+		_mm256_storeu_si256((__m256i *) &buf[j], _mm256_xor_si256(a, b));
+	}
+	fill_scalar(buf, j, len, dn, dm);
+}
+
+__attribute__((target("avx2")))
+static uint64_t check_avx2(const uint8_t *buf, size_t start, size_t len,
+		size_t dn, size_t dm)
+{
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+					     1, 2, 2, 3, 2, 3, 3, 4,
+					     0, 1, 1, 2, 1, 2, 2, 3,
+					     1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+	size_t j = start;
+
+	for (; j + 32 <= len; j += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) &buf[j]);
+		x = _mm256_xor_si256(x, _mm256_loadu_si256((const __m256i *) &buf[j - dn]));
+		x = _mm256_xor_si256(x, _mm256_loadu_si256((const __m256i *) &buf[j - dm]));
+
+		// Count bits per nibble with a lookup table
+		__m256i lo = _mm256_and_si256(x, low_mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask);
+		__m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+					      _mm256_shuffle_epi8(lut, hi));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *) lanes, acc);
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+		check_scalar(buf, j, len, dn, dm);
+}
+
+static const struct prbs_impl impl_avx2 = {
+	"avx2", fill_avx2, check_avx2
+};
+#endif // WITH_X86_SIMD
+
+/**
+ * Select best implementation for this CPU
+ */
+static const struct prbs_impl *get_impl(void)
+{
+	static const struct prbs_impl *impl = NULL;
+
+	if (impl == NULL) {
+#ifdef WITH_X86_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			impl = &impl_avx2;
+		} else if (__builtin_cpu_supports("ssse3")) {
+			impl = &impl_ssse3;
+		} else
+#endif // WITH_X86_SIMD
+		{
+			impl = &impl_scalar;
+		}
+	}
+
+	return impl;
+}
+
+enum prbs_type prbs_parse(const char *name)
+{
+	size_t i;
+
+	if (strncasecmp(name, "prbs", 4) == 0) {
+		name += 4;
+	}
+	for (i=0; i < sizeof(polys) / sizeof(polys[0]); i++) {
+		if (strcasecmp(name, &polys[i].name[4]) == 0) {
+			return polys[i].type;
+		}
+	}
+	return PRBS_NONE;
+}
+
+const char *prbs_name(enum prbs_type type)
+{
+	const struct prbs_poly *poly = get_poly(type);
+	return (poly != NULL) ? poly->name : "none";
+}
+
+const char *prbs_impl_name(void)
+{
+	return get_impl()->name;
+}
+
+void prbs_init(struct prbs_gen *gen, enum prbs_type type)
+{
+	const struct prbs_poly *poly = get_poly(type);
+	uint8_t bits[PRBS_MAX_HISTORY * 8];
+	size_t i;
+
+	memset(gen, 0, sizeof(*gen));
+	gen->type = type;
+	if (poly == NULL) {
+		return;
+	}
+
+	// Run the bit-serial LFSR, seeded with all ones, to create the
+	// history the byte-wise generator starts from.
+	for (i=0; i < poly->dn * 8; i++) {
+		if (i < poly->n) {
+			bits[i] = 1;
+		} else {
+			bits[i] = bits[i - poly->n] ^ bits[i - poly->m];
+		}
+		gen->history[i / 8] |= bits[i] << (i % 8);
+	}
+}
+
+void prbs_fill(struct prbs_gen *gen, uint8_t *buf, size_t len)
+{
+	const struct prbs_poly *poly = get_poly(gen->type);
+	size_t dn, dm;
+	size_t j;
+
+	if (poly == NULL) {
+		return;
+	}
+	dn = poly->dn;
+	dm = poly->dm;
+
+	// First bytes depend on the history of the previous call
+	for (j=0; j < len && j < dn; j++) {
+		uint8_t a = gen->history[j];
+		uint8_t b = (j < dm) ? gen->history[dn - dm + j] : buf[j - dm];
+		buf[j] = a ^ b;
+	}
+	if (len > dn) {
+		get_impl()->fill(buf, dn, len, dn, dm);
+	}
+
+	// Update history
+	if (len >= dn) {
+		memcpy(gen->history, &buf[len - dn], dn);
+	} else {
+		memmove(gen->history, &gen->history[len], dn - len);
+		memcpy(&gen->history[dn - len], buf, len);
+	}
+}
+
+void prbs_check(enum prbs_type type, const uint8_t *buf, size_t len,
+		struct prbs_stats *stats)
+{
+	const struct prbs_poly *poly = get_poly(type);
+
+	// The first dn bytes are only used to synchronize
+	if (poly == NULL || len <= poly->dn) {
+		return;
+	}
+
+	stats->syndrome += get_impl()->check(buf, poly->dn, len, poly->dn, poly->dm);
+	stats->bits += (len - poly->dn) * 8;
+}
+
+uint64_t prbs_bit_errors(const struct prbs_stats *stats)
+{
+	return (stats->syndrome + 2) / 3;
+}
+
+/**
+ * P(X <= k) for X Poisson distributed with mean lambda
+ */
+static double poisson_cdf(uint64_t k, double lambda)
+{
+	// Sum terms relative to the k'th term to prevent underflow
+	double sum = 0;
+	double term = 1;
+	uint64_t i;
+	for (i=k; ; i--) {
+		sum += term;
+		if (i == 0) break;
+		term *= i / lambda;
+		if (term < 1e-17 * sum) break;
+	}
+
+	return exp(-lambda + k * log(lambda) - lgamma(k + 1.0)) * sum;
+}
+
+double prbs_ber_upper_bound(const struct prbs_stats *stats, double confidence)
+{
+	uint64_t errors = prbs_bit_errors(stats);
+	double lambda;
+
+	if (stats->bits == 0) {
+		return 1;
+	}
+
+	if (errors <= 1000) {
+		// Find mean at which observing this few errors becomes
+		// unlikely
+		double lo = 0;
+		double hi = errors + 1;
+		while (poisson_cdf(errors, hi) > 1 - confidence) {
+			hi *= 2;
+		}
+		for (int i=0; i < 100; i++) {
+			double mid = (lo + hi) / 2;
+			if (poisson_cdf(errors, mid) > 1 - confidence) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+		lambda = hi;
+	} else {
+		// Wilson-Hilferty approximation; z is the normal quantile
+		double lo = 0;
+		double hi = 10;
+		for (int i=0; i < 100; i++) {
+			double mid = (lo + hi) / 2;
+			if (0.5 * erfc(-mid / sqrt(2)) < confidence) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+		double z = hi;
+		double k = errors + 1.0;
+		lambda = k * pow(1 - 1 / (9 * k) + z / (3 * sqrt(k)), 3);
+	}
+
+	double ber = lambda / stats->bits;
+	return (ber < 1) ? ber : 1;
+}
+
+void prbs_print_report(enum prbs_type type, const struct prbs_stats *stats)
+{
+	uint64_t bit_errors = prbs_bit_errors(stats);
+
+	printf("Bit Error Rate (%s):\n", prbs_name(type));
+	printf(" - bits checked: %lu\n", stats->bits);
+	printf(" - bit errors:   %lu\n", bit_errors);
+	printf(" - BER:          %g\n", stats->bits ? (double) bit_errors / stats->bits : 0);
+	printf(" - BER upper bound (%.0f%% confidence): %g\n",
+			PRBS_BER_CONFIDENCE * 100,
+			prbs_ber_upper_bound(stats, PRBS_BER_CONFIDENCE));
+}
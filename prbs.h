@@ -0,0 +1,111 @@
+/**
+ * prbs.h - Pseudo Random Binary Sequence generator and checker
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __PRBS_H__
+#define __PRBS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Supported sequences, ITU-T O.150 polynomials
+ */
+enum prbs_type {
+	PRBS_NONE = 0,
+	PRBS7,  // x^7 + x^6 + 1
+	PRBS15, // x^15 + x^14 + 1
+	PRBS23, // x^23 + x^18 + 1
+	PRBS31, // x^31 + x^28 + 1
+};
+
+// Max. distance in bytes between a byte and the bytes it is derived from
+#define PRBS_MAX_HISTORY 64
+
+/**
+ * Generator state
+ */
+struct prbs_gen {
+	enum prbs_type type;
+	uint8_t history[PRBS_MAX_HISTORY]; // Last generated bytes
+};
+
+/**
+ * Checker statistics
+ */
+struct prbs_stats {
+	uint64_t bits;     // Bits checked
+	uint64_t syndrome; // Bits that didn't match the sequence
+};
+
+/**
+ * Parse sequence name, e.g. "prbs31" or "31"
+ *
+ * @returns sequence type, or PRBS_NONE if unknown
+ */
+enum prbs_type prbs_parse(const char *name);
+const char *prbs_name(enum prbs_type type);
+
+/**
+ * Name of the implementation selected for this CPU
+ */
+const char *prbs_impl_name(void);
+
+void prbs_init(struct prbs_gen *gen, enum prbs_type type);
+
+/**
+ * Fill buffer with the next part of the sequence
+ */
+void prbs_fill(struct prbs_gen *gen, uint8_t *buf, size_t len);
+
+/**
+ * Check that a buffer contains a part of the sequence
+ *
+ * The checker is self-synchronizing: the start of the buffer is used to
+ * predict the rest, so it doesn't matter where in the sequence the buffer
+ * starts. Because every byte is predicted from two earlier bytes, a single
+ * bit error shows up as 3 syndrome bits.
+ */
+void prbs_check(enum prbs_type type, const uint8_t *buf, size_t len,
+		struct prbs_stats *stats);
+
+/**
+ * Estimated bit errors from the syndrome
+ */
+uint64_t prbs_bit_errors(const struct prbs_stats *stats);
+
+/**
+ * Upper bound of the bit error rate at the given confidence level
+ *
+ * Assumes bit errors are Poisson distributed.
+ */
+double prbs_ber_upper_bound(const struct prbs_stats *stats, double confidence);
+
+// Confidence level of reported BER upper bound
+#define PRBS_BER_CONFIDENCE 0.95
+
+/**
+ * Print bit error rate report of a checked sequence
+ */
+void prbs_print_report(enum prbs_type type, const struct prbs_stats *stats);
+
+#endif // __PRBS_H__
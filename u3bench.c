@@ -24,6 +24,7 @@
 #define _POSIX_C_SOURCE 200809L
 #define _BSD_SOURCE
 #define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,8 +38,22 @@
 #include <libusb.h>
 #include <math.h>
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include "u3loop_defines.h"
+#include "u3verify.h"
+#include "prbs.h"
+#include "histogram.h"
+#include "usbfs.h"
+#include "xferbuf.h"
+#include "u3dev.h"
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
@@ -49,19 +64,49 @@
 #define IFNUM 0
 #define ALTIFNUM 1
 
-#define BUFFER_CNT 8      // Amount of transfers to submit to libusb; must be an even number.
+#define DEFAULT_QUEUE_DEPTH 8      // Amount of transfers to submit to libusb; split over IN and OUT in rw mode
 #define DEFAULT_TRANSFER_SIZE  (65*1024)  // Amount of bytes to read/write at a time
+#define LOOPBACK_TRANSFER_SIZE 0x10000    // Default transfer size in loopback mode; must fit device buffers
 
 #define USB_TIMEOUT 2000	//2000 millisecs == 2 seconds 
-#define MAX_DEVICE_WAIT 10	// Time in seconds to wait for re-enumration
 
 #define DEFAULT_DISPLAY_IVAL 1
 
-#if (BUFFER_CNT & 1)
-# error "BUFFER_CNT must be a multiple of 2"
-#endif
+#define DEFAULT_SWEEP_TIME 3	// Measurement time in seconds per sweep point
+#define SWEEP_WARMUP_MS 500	// Time to run before measuring a sweep point
+#define SWEEP_KNEE_PCT 95	// Knee is first point reaching this % of max.
+#define SIZE_SWEEP_FACTOR 2	// Transfer size multiplier between sweep steps
+#define MAX_CONFIG_POINTS 32	// Max. configurations measured per mode
+#define DEV_BUFFER_MEM 0x18000	// Device buffer memory; USB3Test uses 2 x 0xc000
+
+
+#define DEFAULT_ISO_PACKETS 32	// Iso. packets per transfer
+
+#define LOAD_QUEUE_DEPTH 8	// Transfers of background load, split over IN and OUT
+
+#define MAX_JOB_LEN 512		// Max. length of a daemon job description
+#define JOB_TIMEOUT_MS 5000	// Max. time for a daemon client to send its job
+
+#define MAX_DEVICES 16		// Max. devices to test at a time
+
+#define MAX_GAPS 16		// Max. idle gap lengths in burst mode
+
+#define USBFS_MEMORY_MB_PATH "/sys/module/usbcore/parameters/usbfs_memory_mb"
+#define URB_OVERHEAD 512	// Kernel memory accounted per URB besides its buffer
+#define FIT_MIN_TRANSFER_SIZE (16*1024) // Transfer size to shrink to before reducing queue depth
 
-int terminate = false;
+#define CACHE_LINE_SIZE 64
+#define EVENT_TICK_MS 10	// Max. time between statistics publications by event thread
+#define REPORT_TICK_MS 10	// Reporter thread poll interval
+
+#define PACE_TICK_US 250	// Event thread poll interval when pacing
+#define PACE_BURST_US 1000	// Max. time worth of tokens a pacer may save up
+#define PACE_WINDOW_MS 100	// Interval to compare achieved rate to target
+#define PACE_SHORT_PCT 1	// Window is short if this % below target
+
+#define SAMPLE_MS 100		// Device error counter and voltage sample interval
+
+atomic_int terminate = false;
 
 unsigned int verbose = 0;
 
@@ -76,9 +121,59 @@ struct host_errors_t {
 	int overflow;
 };
 
+struct iso_counters {
+	uint64_t packets;       // Packets in completed transfers
+	uint64_t lost;          // Packets completed with an error status
+	uint64_t short_packets; // Packets shorter than the reserved size
+};
+
 struct stat_counters {
 	uint64_t tx_bytes;
 	uint64_t rx_bytes;
+	uint64_t tx_xfers; // Completed transfers
+	uint64_t rx_xfers;
+
+	// Isochronous transfers only
+	struct iso_counters tx_iso;
+	struct iso_counters rx_iso;
+
+	// Interrupt transfers only, service intervals without completion
+	uint64_t tx_missed;
+	uint64_t rx_missed;
+
+	uint64_t ctrl_xfers; // Completed control transfers
+	uint64_t ctrl_errors; // Failed control transfers, not in host_errors
+};
+
+// VBUS voltage samples in mV
+struct volt_stats {
+	uint32_t samples;
+	uint64_t sum;
+	uint16_t min;
+	uint16_t max;
+};
+
+static inline void volt_record(struct volt_stats *v, uint16_t mv)
+{
+	if (mv < v->min || v->samples == 0) v->min = mv;
+	if (mv > v->max) v->max = mv;
+	v->sum += mv;
+	v->samples++;
+}
+
+// Achieved rate of paced traffic, in windows of PACE_WINDOW_MS
+struct pace_stats {
+	uint64_t windows;
+	uint64_t short_windows;	// Windows more than PACE_SHORT_PCT below target
+	double max_shortfall;	// Largest shortfall of a window, in % of target
+};
+
+// Transfer buffer allocation
+enum buf_mode {
+	BUF_AUTO = 0,	// Device memory if supported, else malloc()
+	BUF_DEV_MEM,	// Device memory, zero-copy DMA
+	BUF_MALLOC,	// malloc(), kernel copies through its own buffers
+	BUF_HUGE,	// Hugepages, locked, on NUMA node of host controller
 };
 
 // Current statistics state
@@ -87,8 +182,60 @@ struct state_t {
 	// Start time
 	struct timespec start_time;
 
+	// Parameters of running test
+	const struct test_params *params;
+
+	// Device name in reports, NULL if only one device is tested
+	const char *name;
+
+	// Transfer buffers used, and their placement if BUF_HUGE
+	enum buf_mode buffers;
+	enum xferbuf_pages buf_pages;
+	bool buf_locked;
+	int buf_node;		// NUMA node of buffers, -1 if unknown
+	int ctrl_node;		// NUMA node of host controller, -1 if unknown
+	// Process CPU time at start and end of test
+	struct timespec cpu_start;
+	struct timespec cpu_stop;
+
 	// # of transfers submitted to libusb
 	unsigned int active_transfers;
+	// Set to stop resubmitting transfers
+	bool stopping;
+
+	// Sequence stamped data verification
+	struct u3verify_tx verify_tx;
+	struct u3verify_rx verify_rx;
+
+	// PRBS data generation and checking
+	struct prbs_gen prbs_tx;
+	struct prbs_stats prbs_rx;
+
+	// Submit to completion latency in ns., since last measurement
+	struct histogram tx_latency;
+	struct histogram rx_latency;
+	// Submit to completion latency in ns., since start
+	struct histogram cum_tx_latency;
+	struct histogram cum_rx_latency;
+
+	// Control transfer latency in ns.
+	struct histogram ctrl_latency;
+	struct histogram cum_ctrl_latency;
+
+	// Bytes short of reserved size per iso. packet, since start
+	struct histogram tx_iso_deficit;
+	struct histogram rx_iso_deficit;
+
+	// Paced traffic only, since start
+	struct pace_stats tx_pace;
+	struct pace_stats rx_pace;
+
+	// Completion time of last interrupt transfer
+	struct timespec tx_last_completion;
+	struct timespec rx_last_completion;
+	// Deviation of interrupt completion interval in ns., since start
+	struct histogram tx_jitter;
+	struct histogram rx_jitter;
 
 	// operations counter
 	unsigned long long ops;
@@ -100,6 +247,9 @@ struct state_t {
 	struct host_errors_t host_errors;
 	// Device error counters, since last measurement
 	struct u3loop_errors dev_errors;
+	// VBUS voltage, since last measurement and since start
+	struct volt_stats volt;
+	struct volt_stats cum_volt;
 
 	//***** Written by measurement *****//
 	// host error counters, since start
@@ -111,6 +261,162 @@ struct state_t {
 	struct timespec measurement_time;
 	// Counters at last measurement
 	struct stat_counters measurement;
+
+	// Time test was stopped
+	struct timespec stop_time;
+};
+
+// Token bucket pacing the transfers of one direction. Transfers that find
+// the bucket empty are parked, and submitted by the event thread once enough
+// tokens have been added.
+struct pacer {
+	double rate;			// Target rate in bytes per ns., 0 = not paced
+	double burst;			// Max. tokens
+	double tokens;			// Bytes that may be submitted now
+	struct timespec last;		// Time tokens were last added
+	struct libusb_transfer **parked; // FIFO of transfers waiting for tokens
+	unsigned int parked_size;
+	unsigned int parked_head;
+	unsigned int parked_cnt;
+	uint64_t window_bytes;		// Bytes completed in current window
+	struct timespec window_start;
+};
+
+// Asynchronous sampling of device telemetry with a vendor request. Error
+// counters are cleared by reading them, so every sample is added to the
+// state.
+struct sampler {
+	struct libusb_transfer *xfer;	// NULL if not sampling
+	struct state_t *state;
+	const char *what;		// Sampled data, for warnings
+	bool busy;			// Transfer submitted
+	bool failed;			// Stop sampling, device doesn't cooperate
+	struct timespec last;		// Submit time of last sample
+};
+
+// Transfers of a test running on one device
+struct test_run {
+	struct libusb_device_handle *dev;
+	struct state_t *state;
+	struct libusb_transfer **xfers;
+	struct xfer_ctx *ctxs;
+	unsigned int xfer_cnt;
+	int use_dev_mem;
+	struct xferbuf_pool pool;	// Buffers if BUF_HUGE
+	struct pacer tx_pacer;
+	struct pacer rx_pacer;
+	struct sampler errs;
+	struct sampler volt;
+};
+
+// Snapshot of interval statistics, handed from the event thread to the
+// reporter. The reporter bumps req, the event thread fills in the snapshot,
+// clears its interval statistics and sets ack to req.
+struct stat_slot {
+	_Alignas(CACHE_LINE_SIZE) atomic_uint req;
+	_Alignas(CACHE_LINE_SIZE) atomic_uint ack;
+	struct timespec time;
+	unsigned long long ops;
+	struct stat_counters ctrs;
+	struct host_errors_t host_errors;
+	struct u3loop_errors dev_errors;
+	struct volt_stats volt;
+	struct histogram tx_latency;
+	struct histogram rx_latency;
+	struct histogram ctrl_latency;
+};
+
+// State shared between run_tests() and its event thread
+struct event_loop {
+	struct test_run *runs;
+	unsigned int run_cnt;
+	const struct test_params *params;
+	struct stat_slot *slots;	// One per run
+	atomic_int stop;		// Set by reporter to end the event thread
+	atomic_int failed;		// Transfers could not be resubmitted
+	atomic_int warmed_up;		// start_time is valid
+	struct timespec start_time;	// Start of measurement
+};
+
+// Per URB context of usbfs backend
+struct urb_ctx {
+	struct usbdevfs_urb urb;
+	struct timespec submit_time;
+	int zero_copy;
+};
+
+// Per transfer context
+struct xfer_ctx {
+	struct state_t *state;
+	struct pacer *pacer;		// NULL if not paced
+	bool dev_mem;			// Buffer from libusb_dev_mem_alloc()
+	struct timespec submit_time;
+	uint64_t latency;		// Of last completed transfer, in ns.
+};
+
+// Parameters of a single test run
+struct test_params {
+	int mode;
+	size_t transfer_size;
+	unsigned int depth_in;  // # of IN transfers to keep queued
+	unsigned int depth_out; // # of OUT transfers to keep queued
+	time_t time_limit;      // Seconds, 0 = forever
+	unsigned int warmup_ms; // Time to run before starting measurement
+	int report_ival;        // Seconds, 0 = never
+	bool verify;            // Send sequence stamped data and verify it
+	enum prbs_type prbs;    // Send PRBS data, and check it in loopback mode
+
+	int ep_type;            // U3LOOP_EP_TYPE_BULK, _ISO or _INT
+	// Isochronous and interrupt endpoints only
+	unsigned int ep_bytes;         // Reserved bytes per service interval
+	unsigned int ep_interval_usec; // Service interval
+	// Isochronous endpoints only
+	unsigned int iso_packets;      // Packets per transfer
+
+	unsigned int ctrl_depth;       // # of control transfers to keep queued
+	struct libusb_control_setup ctrl_setup; // Read request to send
+	int event_cpu;			// CPU to run USB event handling on, -1 = any
+	bool usbfs;			// Use raw usbfs URBs instead of libusb
+	enum buf_mode buffers;		// Transfer buffer allocation
+	double tx_rate;			// Pacing target in Mbit/s, 0 = flat out
+	double rx_rate;
+	bool telemetry;			// Sample device error counters and
+					// voltage, PassMark only
+	// Burst mode only, transfers are submitted once per burst
+	unsigned int gap_cnt;		// Idle gaps to cycle through, 0 = no bursts
+	unsigned int gaps_usec[MAX_GAPS];
+};
+
+// Result of a single sweep step
+struct sweep_point {
+	unsigned int depth_in;
+	unsigned int depth_out;
+	size_t transfer_size;
+	double tx_mbps;
+	double rx_mbps;
+	double tx_xfers_sec; // Completed transfers per second
+	double rx_xfers_sec;
+};
+
+// Result of a single device configuration sweep step
+struct config_point {
+	struct u3loop_config config;
+	double tx_mbps;
+	double rx_mbps;
+	uint64_t tx_p99;	// Latency in ns.
+	uint64_t rx_p99;
+	double config_sec;	// Time to apply configuration, not measured
+};
+
+// Bulk load on a second device
+struct bulk_load {
+	struct libusb_device_handle *dev;
+	struct libusb_transfer *xfers[LOAD_QUEUE_DEPTH];
+	unsigned int active_transfers;
+	bool stopping;
+	uint64_t bytes;
+	struct timespec start_time;
+	struct timespec stop_time;
 };
 
 struct test_device_type {
@@ -134,32 +440,93 @@ struct test_device_type test_device_types[] = {
 
 void terminator(__attribute__((unused)) int signum) {
 	terminate = true;
+	u3dev_stop = true;
 }
 
 void usage()
 {
 	fprintf(stderr, "Benchmark test for USB 3.0 loopback plug - %s\n", VERSION);
-	fprintf(stderr, "Usage: u3bench [-Cvh] [-D BBB.DDD] [-i SEC] [-I VID:PID] [-l SIZE]\n"
-			"               [-m MODE] [-s SERIAL] [-S SPEED] [-t SEC] [-T TYPE]\n");
+	fprintf(stderr, "Usage: u3bench [-CUVvh] [-A CPU[,CPU]] [-B SERIAL] [-c NUM] [-d SOCKET]\n"
+			"               [-D BBB.DDD[,...]] [-E TYPE] [-G USEC[,...]] [-i SEC]\n"
+			"               [-I VID:PID] [-K MODES] [-l SIZE] [-L MIN:MAX] [-m MODE]\n"
+			"               [-M BUF] [-n PACKETS] [-p IVAL] [-P PRBS] [-q DEPTH]\n"
+			"               [-Q MAX] [-r RATE[,RATE]] [-s SERIAL[,...]|all] [-S SPEED]\n"
+			"               [-t SEC] [-T TYPE] [-X MODES]\n");
 	fprintf(stderr, "\nOptions:\n");
+	fprintf(stderr, " -A CPU     Pin USB event handling thread to CPU. Use CPU,CPU to also\n");
+	fprintf(stderr, "            pin the reporting thread\n");
+	fprintf(stderr, " -B SERIAL  Run bulk read/write load on a second device during the test\n");
+	fprintf(stderr, " -c NUM     Keep NUM read control requests queued and report their\n");
+	fprintf(stderr, "            rate and latency. Use with '-q 0' for control transfers only\n");
 	fprintf(stderr, " -C         Only print CSV report at end and errors.\n");
+	fprintf(stderr, " -d SOCKET  Daemon mode; keep device configured and run jobs received on\n");
+	fprintf(stderr, "            Unix socket SOCKET. A job is one line of KEY=VALUE pairs:\n");
+	fprintf(stderr, "            mode=MODE size=SIZE depth=DEPTH ctrl=NUM time=SEC ival=SEC\n");
+	fprintf(stderr, "            csv=0|1. Other settings come from the command line.\n");
 	fprintf(stderr, " -D BBB.DDD Use specific device given by bus & device number,\n");
-	fprintf(stderr,	"            as repoted by 'lsusb'\n");
+	fprintf(stderr,	"            as repoted by 'lsusb'. Use a comma separated list to\n");
+	fprintf(stderr,	"            test multiple devices at a time\n");
+	fprintf(stderr, " -E TYPE    Endpoint type\n");
+	fprintf(stderr, "              bulk = Bulk (Default)\n");
+	fprintf(stderr, "              iso  = Isochronous, reports packet loss and deficit\n");
+	fprintf(stderr, "                     against the reserved bandwidth\n");
+	fprintf(stderr, "              int  = Interrupt, reports completion interval jitter\n");
+	fprintf(stderr, "                     and missed service intervals\n");
+	fprintf(stderr, " -G USEC    Burst mode; enable Link Power Management and alternate idle\n");
+	fprintf(stderr, "            gaps of USEC with bursts of DEPTH transfers per endpoint.\n");
+	fprintf(stderr, "            Reports latency of the first transfer after a gap, per gap\n");
+	fprintf(stderr, "            length. Use a comma separated list to cycle through gaps\n");
 	fprintf(stderr, " -i SEC     Report intermediate statistics every SEC seconds. 0 = never.\n");
 	fprintf(stderr, " -I VID:PID Use specific device by USB vendor and product ID\n");
+	fprintf(stderr, " -K MODES   Sweep device configuration: burst length, buffer count and\n");
+	fprintf(stderr, "            size, and HS NAK interval. Reports a ranked table and the\n");
+	fprintf(stderr, "            best configuration for every mode in MODES, a comma\n");
+	fprintf(stderr, "            separated list of modes (see '-m') or 'all'\n");
 	fprintf(stderr, " -l SIZE    Set transfer size(default: %dKB)\n", DEFAULT_TRANSFER_SIZE / 1024);
+	fprintf(stderr, " -L MIN:MAX Sweep transfer size from MIN to MAX bytes, doubling every\n");
+	fprintf(stderr, "            step, and fit a per-transfer overhead model\n");
 	fprintf(stderr, " -m MODE    Test mode\n");
 	fprintf(stderr, "              rw = Read and write (Default)\n");
 	fprintf(stderr, "              r  = Read\n");
 	fprintf(stderr, "              w  = Write\n");
-	fprintf(stderr, " -s SERIAL  Use device with this serial number\n");
+	fprintf(stderr, "              l  = Loopback\n");
+	fprintf(stderr, " -M BUF     Transfer buffer allocation\n");
+	fprintf(stderr, "              auto   = Device memory if supported, else malloc (Default)\n");
+	fprintf(stderr, "              dev    = Device memory, zero-copy DMA\n");
+	fprintf(stderr, "              malloc = malloc(), kernel copies the data\n");
+	fprintf(stderr, "              huge   = Pre-faulted and locked hugepages on the NUMA\n");
+	fprintf(stderr, "                       node of the host controller\n");
+	fprintf(stderr, "              ab     = Compare throughput and CPU time per GB of all\n");
+	fprintf(stderr, " -n PACKETS Iso. packets per transfer (default: %d)\n", DEFAULT_ISO_PACKETS);
+	fprintf(stderr, " -p IVAL    Polling interval of iso. and interrupt endpoints (bInterval)\n");
+	fprintf(stderr, " -P PRBS    Write PRBS data; checked and reported as bit error rate in\n");
+	fprintf(stderr, "            loopback mode. PRBS = prbs7, prbs15, prbs23 or prbs31\n");
+	fprintf(stderr, " -q DEPTH   Transfers to keep queued per endpoint (default: %d,\n", DEFAULT_QUEUE_DEPTH);
+	fprintf(stderr, "            %d in rw mode). 0 = no bulk transfers\n", DEFAULT_QUEUE_DEPTH / 2);
+	fprintf(stderr, " -Q MAX     Sweep queue depth from 1 to MAX and report throughput per\n");
+	fprintf(stderr, "            depth. In rw mode IN and OUT are swept separately.\n");
+	fprintf(stderr, " -r RATE    Pace bulk transfers to RATE Mbit/s per direction, and report\n");
+	fprintf(stderr, "            achieved rate and shortfall per %d ms. Use WRITE,READ to\n", PACE_WINDOW_MS);
+	fprintf(stderr, "            pace the directions differently. 0 = not paced\n");
+	fprintf(stderr, " -s SERIAL  Use device with this serial number. Use a comma separated list,\n");
+	fprintf(stderr, "            or 'all' for all devices of the type, to test multiple\n");
+	fprintf(stderr, "            devices at a time and report aggregate throughput\n");
 	fprintf(stderr, " -S SPEED   Force device to work at USB speed\n");
-	fprintf(stderr, "              fs = USB 1.x Full Speed, 12 Mbit/s\n");
-	fprintf(stderr, "              hs = USB 2.0 High Speed, 480 Mbit/s\n");
-	fprintf(stderr, "              ss = USB 3.x Super Speed, 5 Gbit/s\n");
-	fprintf(stderr, " -t SEC     Time limit of test in seconds (0=forever)\n");
+	fprintf(stderr, "              auto = Fastest supported by device and port (Default)\n");
+	fprintf(stderr, "              fs   = USB 1.x Full Speed, 12 Mbit/s\n");
+	fprintf(stderr, "              hs   = USB 2.0 High Speed, 480 Mbit/s\n");
+	fprintf(stderr, "              ss   = USB 3.x Super Speed, 5 Gbit/s\n");
+	fprintf(stderr, " -t SEC     Time limit of test in seconds (0=forever). When sweeping\n");
+	fprintf(stderr, "            this is the time per step (default: %d)\n", DEFAULT_SWEEP_TIME);
 	fprintf(stderr, " -T TYPE    Test device type(use 'list' for available options)\n");
+	fprintf(stderr, " -U         Use raw usbfs URBs instead of libusb for bulk transfers,\n");
+	fprintf(stderr, "            to measure without libusb overhead. Linux only\n");
+	fprintf(stderr, " -V         Send sequence stamped data and verify it. Requires loopback mode\n");
 	fprintf(stderr, " -v         Increase verbosity level. Can be used multiple times\n");
+	fprintf(stderr, " -X MODES   Speed matrix: measure every mode in MODES, a comma separated\n");
+	fprintf(stderr, "            list of modes (see '-m') or 'all', at every speed up to the\n");
+	fprintf(stderr, "            selected speed, and report efficiency relative to the\n");
+	fprintf(stderr, "            theoretical max. of each speed\n");
 	fprintf(stderr, " -h         This help message\n");
 }
 
@@ -170,31 +537,181 @@ void usage_device_types()
 	fprintf(stderr, "  fx3 - Cypress FX3/CX3 with cyfxbulksrcsink example firmware\n");
 }
 
-void print_measurement(struct state_t *s)
+/**
+ * Print latency percentiles in usec. as CSV fields, including leading comma
+ */
+void print_latency_csv(const struct histogram *h)
 {
-	struct timespec now;
+	printf(", %7.1f, %7.1f, %7.1f, %7.1f, %7.1f",
+		hist_percentile(h, 50) / 1000.0,
+		hist_percentile(h, 90) / 1000.0,
+		hist_percentile(h, 99) / 1000.0,
+		hist_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0);
+}
 
-	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
-		perror("clock_gettime");
-		return;
+void print_latency(const char *name, const struct histogram *h)
+{
+	printf(" - %s: min: %.1f, mean: %.1f, p50: %.1f, p90: %.1f, "
+		"p99: %.1f, p99.9: %.1f, max: %.1f\n", name,
+		h->min / 1000.0, hist_mean(h) / 1000.0,
+		hist_percentile(h, 50) / 1000.0,
+		hist_percentile(h, 90) / 1000.0,
+		hist_percentile(h, 99) / 1000.0,
+		hist_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0);
+}
+
+/**
+ * Percentage of the reserved iso. bandwidth that was not used
+ */
+double iso_deficit_pct(const struct test_params *p, uint64_t bytes, uint64_t usec)
+{
+	double reserved = (double) usec * p->ep_bytes / p->ep_interval_usec;
+	if (reserved == 0) {
+		return 0;
+	}
+	return (reserved - bytes) * 100 / reserved;
+}
+
+void print_dev_phy_errors(const struct u3loop_errors *ec) {
+	if (ec->phy_errors & U3LOOP_ERR_PHY_DECODE)
+		printf("   - U3LOOP_ERR_PHY_DECODE\n");
+	if (ec->phy_errors & U3LOOP_ERR_PHY_EB_OVR)
+		printf("   - U3LOOP_ERR_PHY_EB_OVR\n");
+	if (ec->phy_errors & U3LOOP_ERR_PHY_EB_UND)
+		printf("   - U3LOOP_ERR_PHY_EB_UND\n");
+	if (ec->phy_errors & U3LOOP_ERR_PHY_DISPARITY)
+		printf("   - U3LOOP_ERR_PHY_DISPARITY\n");
+	if (ec->phy_errors & U3LOOP_ERR_PHY_CRC5)
+		printf("   - U3LOOP_ERR_PHY_CRC5\n");
+	if (ec->phy_errors & U3LOOP_ERR_PHY_CRC16)
+		printf("   - U3LOOP_ERR_PHY_CRC16\n");
+	if (ec->phy_errors & U3LOOP_ERR_PHY_CRC32)
+		printf("   - U3LOOP_ERR_PHY_CRC32\n");
+	if (ec->phy_errors & U3LOOP_ERR_PHY_TRAINING)
+		printf("   - U3LOOP_ERR_PHY_TRAINING\n");
+	if (ec->phy_errors & U3LOOP_ERR_PHY_LOCK_LOSS)
+		printf("   - U3LOOP_ERR_PHY_LOCK_LOSS\n");
+	if (ec->phy_errors & U3LOOP_ERR_PHY_UNDEFINED)
+		printf("   - U3LOOP_ERR_PHY_UNDEFINED\n");
+}
+
+void print_dev_ll_errors(const struct u3loop_errors *ec) {
+	if (ec->ll_errors & U3LOOP_ERR_LL_HP_TIMEOUT_EN)
+		printf("   - U3LOOP_ERR_LL_HP_TIMEOUT_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_RX_SEQ_NUM_ERR_EN)
+		printf("   - U3LOOP_ERR_LL_RX_SEQ_NUM_ERR_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_RX_HP_FAIL_EN)
+		printf("   - U3LOOP_ERR_LL_RX_HP_FAIL_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_MISSING_LGOOD_EN)
+		printf("   - U3LOOP_ERR_LL_MISSING_LGOOD_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_MISSING_LCRD_EN)
+		printf("   - U3LOOP_ERR_LL_MISSING_LCRD_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_CREDIT_HP_TIMEOUT_EN)
+		printf("   - U3LOOP_ERR_LL_CREDIT_HP_TIMEOUT_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_PM_LC_TIMEOUT_EN)
+		printf("   - U3LOOP_ERR_LL_PM_LC_TIMEOUT_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_TX_SEQ_NUM_ERR_EN)
+		printf("   - U3LOOP_ERR_LL_TX_SEQ_NUM_ERR_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_HDR_ADV_TIMEOUT_EN)
+		printf("   - U3LOOP_ERR_LL_HDR_ADV_TIMEOUT_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_HDR_ADV_HP_EN)
+		printf("   - U3LOOP_ERR_LL_HDR_ADV_HP_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_HDR_ADV_LCRD_EN)
+		printf("   - U3LOOP_ERR_LL_HDR_ADV_LCRD_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_HDR_ADV_LGO_EN)
+		printf("   - U3LOOP_ERR_LL_HDR_ADV_LGO_EN\n");
+	if (ec->ll_errors & U3LOOP_ERR_LL_UNDEFINED)
+		printf("   - U3LOOP_ERR_LL_UNDEFINED\n");
+}
+
+double volt_mean(const struct volt_stats *v)
+{
+	return v->samples ? (double) v->sum / v->samples : 0;
+}
+
+void print_volt_csv(const struct volt_stats *v)
+{
+	printf(", %5u, %5.0f, %5u", v->min, volt_mean(v), v->max);
+}
+
+void print_measurement_header(const struct test_params *p, bool with_device)
+{
+	if (with_device) {
+		printf("Device, ");
+	}
+	printf("Time, Ops, "
+		"Speed(mbps), Avg. Speed(mbps), "
+		"TX Speed(mbps), TX Avg. Speed(mbps), "
+		"RX Speed(mbps), RX Avg. Speed(mbps), "
+		"Host Error count, "
+		"TX p50(us), TX p90(us), TX p99(us), TX p99.9(us), TX max(us), "
+		"RX p50(us), RX p90(us), RX p99(us), RX p99.9(us), RX max(us)");
+	if (p->ep_type == U3LOOP_EP_TYPE_ISO) {
+		printf(", TX lost, TX short, TX deficit(%%), "
+			"RX lost, RX short, RX deficit(%%)");
+	} else if (p->ep_type == U3LOOP_EP_TYPE_INT) {
+		printf(", TX missed, RX missed");
 	}
+	if (p->ctrl_depth > 0) {
+		printf(", Ctrl Ops/s, Ctrl Errors, Ctrl p50(us), Ctrl p90(us), "
+			"Ctrl p99(us), Ctrl p99.9(us), Ctrl max(us)");
+	}
+	if (p->telemetry) {
+		printf(", Phy. Error Count, Phy Error Mask, "
+			"Link Error Count, Link Error Mask, "
+			"VBUS min(mV), VBUS mean(mV), VBUS max(mV)");
+	}
+	printf("\n");
+}
+
+/**
+ * Add interval error counters to the cumulative counters
+ */
+void add_errors(struct state_t *s, const struct host_errors_t *host,
+		const struct u3loop_errors *dev)
+{
+	s->cum_dev_errors.phy_error_cnt += dev->phy_error_cnt;
+	s->cum_dev_errors.phy_errors    |= dev->phy_errors;
+	s->cum_dev_errors.ll_error_cnt  += dev->ll_error_cnt;
+	s->cum_dev_errors.ll_errors     |= dev->ll_errors;
+
+	s->cum_host_errors.data_corrupt += host->data_corrupt;
+	s->cum_host_errors.error     += host->error;
+	s->cum_host_errors.length    += host->length;
+	s->cum_host_errors.stall     += host->stall;
+	s->cum_host_errors.timeout   += host->timeout;
+	s->cum_host_errors.overflow  += host->overflow;
+}
+
+/**
+ * Add errors that weren't part of a measurement yet to the cumulative
+ * counters, when the test stopped
+ */
+void fold_errors(struct state_t *s)
+{
+	add_errors(s, &s->host_errors, &s->dev_errors);
+	memset(&s->host_errors, 0, sizeof(s->host_errors));
+	memset(&s->dev_errors, 0, sizeof(s->dev_errors));
+}
+
+/**
+ * Print interval statistics from a snapshot taken by the event thread
+ *
+ * Only touches the reporter owned fields of s: the cumulative error
+ * counters and the previous measurement.
+ */
+void print_measurement(struct state_t *s, const struct stat_slot *snap)
+{
+	const struct timespec now = snap->time;
 
 	// Update cumulative counters
-	s->cum_dev_errors.phy_error_cnt += s->dev_errors.phy_error_cnt;
-	s->cum_dev_errors.phy_errors    |= s->dev_errors.phy_errors;
-	s->cum_dev_errors.ll_error_cnt  += s->dev_errors.ll_error_cnt;
-	s->cum_dev_errors.ll_errors     |= s->dev_errors.ll_errors;
-
-	s->cum_host_errors.data_corrupt += s->host_errors.data_corrupt;
-	s->cum_host_errors.error     += s->host_errors.error;
-	s->cum_host_errors.length    += s->host_errors.length;
-	s->cum_host_errors.stall     += s->host_errors.stall;
-	s->cum_host_errors.timeout   += s->host_errors.timeout;
-	s->cum_host_errors.overflow  += s->host_errors.overflow;
+	add_errors(s, &snap->host_errors, &snap->dev_errors);
 
 	// Calculate values
-	uint64_t tx_bytes = (s->ctrs.tx_bytes - s->measurement.tx_bytes);
-	uint64_t rx_bytes = (s->ctrs.rx_bytes - s->measurement.rx_bytes);
+	uint64_t tx_bytes = (snap->ctrs.tx_bytes - s->measurement.tx_bytes);
+	uint64_t rx_bytes = (snap->ctrs.rx_bytes - s->measurement.rx_bytes);
 	uint64_t ival_usec = (now.tv_sec - s->measurement_time.tv_sec) * 1000000 +
 				(now.tv_nsec - s->measurement_time.tv_nsec) / 1000;
 
@@ -213,32 +730,112 @@ void print_measurement(struct state_t *s)
 	double tx_avg_mbps = INFINITY;
 	double rx_avg_mbps = INFINITY;
 	if (total_time_usec != 0) {
-		avg_mbps = (s->ctrs.rx_bytes + s->ctrs.tx_bytes) * 8 / total_time_usec;
-		tx_avg_mbps = s->ctrs.tx_bytes * 8 / total_time_usec;
-		rx_avg_mbps = s->ctrs.rx_bytes * 8 / total_time_usec;
+		avg_mbps = (snap->ctrs.rx_bytes + snap->ctrs.tx_bytes) * 8 / total_time_usec;
+		tx_avg_mbps = snap->ctrs.tx_bytes * 8 / total_time_usec;
+		rx_avg_mbps = snap->ctrs.rx_bytes * 8 / total_time_usec;
 	}
 
 	int host_errors =
-		s->host_errors.data_corrupt +
-		s->host_errors.error +
-		s->host_errors.length +
-		s->host_errors.stall +
-		s->host_errors.timeout +
-		s->host_errors.overflow;
+		snap->host_errors.data_corrupt +
+		snap->host_errors.error +
+		snap->host_errors.length +
+		snap->host_errors.stall +
+		snap->host_errors.timeout +
+		snap->host_errors.overflow;
 
+	if (s->name != NULL) {
+		printf("%s, ", s->name);
+	}
 	printf("% 4ld.0, % 8lld, %7.2f, %7.2f, "
 		"%7.2f, %7.2f, %7.2f, %7.2f, "
-		"% 4d\n",
-		total_time_usec / 1000000, s->ops, mbps, avg_mbps,
+		"% 4d",
+		total_time_usec / 1000000, snap->ops, mbps, avg_mbps,
 		tx_mbps, tx_avg_mbps, rx_mbps, rx_avg_mbps,
 		host_errors);
-	
-	// Clear non cumulative error counters
-	memset(&s->dev_errors, 0, sizeof(s->dev_errors));
-	memset(&s->host_errors, 0, sizeof(s->host_errors));
+	print_latency_csv(&snap->tx_latency);
+	print_latency_csv(&snap->rx_latency);
+	if (s->params->ep_type == U3LOOP_EP_TYPE_ISO) {
+		const struct iso_counters *c = &snap->ctrs.tx_iso;
+		const struct iso_counters *m = &s->measurement.tx_iso;
+		printf(", %6lu, %6lu, %6.2f",
+			c->lost - m->lost, c->short_packets - m->short_packets,
+			s->params->mode == U3LOOP_MODE_READ ? 0 :
+				iso_deficit_pct(s->params, tx_bytes, ival_usec));
+		c = &snap->ctrs.rx_iso;
+		m = &s->measurement.rx_iso;
+		printf(", %6lu, %6lu, %6.2f",
+			c->lost - m->lost, c->short_packets - m->short_packets,
+			s->params->mode == U3LOOP_MODE_WRITE ? 0 :
+				iso_deficit_pct(s->params, rx_bytes, ival_usec));
+	} else if (s->params->ep_type == U3LOOP_EP_TYPE_INT) {
+		printf(", %6lu, %6lu",
+			snap->ctrs.tx_missed - s->measurement.tx_missed,
+			snap->ctrs.rx_missed - s->measurement.rx_missed);
+	}
+	if (s->params->ctrl_depth > 0) {
+		printf(", %8.0f", ival_usec ? (double) (snap->ctrs.ctrl_xfers -
+				s->measurement.ctrl_xfers) * 1000000 / ival_usec : 0);
+		printf(", %6lu", snap->ctrs.ctrl_errors - s->measurement.ctrl_errors);
+		print_latency_csv(&snap->ctrl_latency);
+	}
+	if (s->params->telemetry) {
+		printf(", % 4d, 0x%04x, % 4d, 0x%04x",
+			snap->dev_errors.phy_error_cnt,
+			snap->dev_errors.phy_errors,
+			snap->dev_errors.ll_error_cnt,
+			snap->dev_errors.ll_errors);
+		print_volt_csv(&snap->volt);
+	}
+	printf("\n");
+
+	// Output might be read by another program while the test runs
+	fflush(stdout);
 
 	s->measurement_time = now;
-	s->measurement = s->ctrs;
+	s->measurement = snap->ctrs;
+}
+
+void print_iso(const char *name, const struct test_params *p,
+		const struct iso_counters *c, const struct histogram *deficit,
+		uint64_t bytes, uint64_t usec)
+{
+	printf(" - %s: packets: %lu, lost: %lu (%.3f%%), short: %lu, "
+		"deficit: %.2f%%\n", name,
+		c->packets, c->lost,
+		c->packets ? (double) c->lost * 100 / c->packets : 0,
+		c->short_packets, iso_deficit_pct(p, bytes, usec));
+	printf("   deficit per packet (bytes): p50: %lu, p99: %lu, max: %lu\n",
+		hist_percentile(deficit, 50), hist_percentile(deficit, 99),
+		deficit->max);
+}
+
+/**
+ * Achieved rate of a paced direction in Mbit/s
+ */
+double pace_mbps(uint64_t bytes, uint64_t usec)
+{
+	return usec ? (double) bytes * 8 / usec : 0;
+}
+
+void print_pace(const char *name, double target, uint64_t bytes,
+		uint64_t usec, const struct pace_stats *ps)
+{
+	double mbps = pace_mbps(bytes, usec);
+
+	printf(" - %s: target: %.2f, achieved: %.2f (%+.2f%%), "
+		"short windows: %lu/%lu, max. shortfall: %.2f%%\n", name,
+		target, mbps, (mbps - target) * 100 / target,
+		ps->short_windows, ps->windows, ps->max_shortfall);
+}
+
+void print_pace_csv(double target, uint64_t bytes, uint64_t usec,
+		const struct pace_stats *ps)
+{
+	double mbps = pace_mbps(bytes, usec);
+
+	printf(", %.2f, %.2f, %.2f, %lu, %lu, %.2f", target, mbps,
+		target ? (mbps - target) * 100 / target : 0,
+		ps->short_windows, ps->windows, ps->max_shortfall);
 }
 
 void print_report(struct state_t *s, bool csv)
@@ -266,7 +863,15 @@ void print_report(struct state_t *s, bool csv)
 		rx_avg_mbps = s->ctrs.rx_bytes * 8;
 	}
 
+	double cpu_sec = (s->cpu_stop.tv_sec - s->cpu_start.tv_sec) +
+			(s->cpu_stop.tv_nsec - s->cpu_start.tv_nsec) / 1e9;
+	uint64_t bytes = s->ctrs.tx_bytes + s->ctrs.rx_bytes;
+	double cpu_per_gb = bytes ? cpu_sec * 1e9 / bytes : 0;
+
 	if (csv) {
+		if (s->name != NULL) {
+			printf("%s, ", s->name);
+		}
 		printf("%lu, ", total_time_usec / 1000000);
 		printf("%llu, ", s->ops);
 		printf("%ld, ", s->ctrs.tx_bytes);
@@ -279,9 +884,72 @@ void print_report(struct state_t *s, bool csv)
 		printf("%u, ", s->cum_host_errors.length);
 		printf("%u, ", s->cum_host_errors.stall);
 		printf("%u, ", s->cum_host_errors.timeout);
-		printf("%u\n", s->cum_host_errors.overflow);
+		printf("%u", s->cum_host_errors.overflow);
+		print_latency_csv(&s->cum_tx_latency);
+		print_latency_csv(&s->cum_rx_latency);
+		if (s->params != NULL && s->params->ep_type == U3LOOP_EP_TYPE_ISO) {
+			printf(", %lu, %lu, %lu, %.2f",
+				s->ctrs.tx_iso.packets, s->ctrs.tx_iso.lost,
+				s->ctrs.tx_iso.short_packets,
+				s->params->mode == U3LOOP_MODE_READ ? 0 :
+					iso_deficit_pct(s->params, s->ctrs.tx_bytes, total_time_usec));
+			printf(", %lu, %lu, %lu, %.2f",
+				s->ctrs.rx_iso.packets, s->ctrs.rx_iso.lost,
+				s->ctrs.rx_iso.short_packets,
+				s->params->mode == U3LOOP_MODE_WRITE ? 0 :
+					iso_deficit_pct(s->params, s->ctrs.rx_bytes, total_time_usec));
+		} else if (s->params != NULL && s->params->ep_type == U3LOOP_EP_TYPE_INT) {
+			printf(", %lu, %.1f, %.1f", s->ctrs.tx_missed,
+				hist_percentile(&s->tx_jitter, 99) / 1000.0,
+				s->tx_jitter.max / 1000.0);
+			printf(", %lu, %.1f, %.1f", s->ctrs.rx_missed,
+				hist_percentile(&s->rx_jitter, 99) / 1000.0,
+				s->rx_jitter.max / 1000.0);
+		}
+		if (s->params != NULL &&
+		    (s->params->tx_rate > 0 || s->params->rx_rate > 0))
+		{
+			print_pace_csv(s->params->tx_rate, s->ctrs.tx_bytes,
+					total_time_usec, &s->tx_pace);
+			print_pace_csv(s->params->rx_rate, s->ctrs.rx_bytes,
+					total_time_usec, &s->rx_pace);
+		}
+		if (s->params != NULL && s->params->ctrl_depth > 0) {
+			printf(", %lu, %.0f", s->ctrs.ctrl_xfers, total_time_usec ?
+				(double) s->ctrs.ctrl_xfers * 1000000 / total_time_usec : 0);
+			printf(", %lu", s->ctrs.ctrl_errors);
+			print_latency_csv(&s->cum_ctrl_latency);
+		}
+		if (s->params != NULL && s->params->verify) {
+			printf(", %lu", s->verify_rx.stats.ok);
+			printf(", %lu", s->verify_rx.stats.corrupt);
+			printf(", %lu", s->verify_rx.stats.lost);
+			printf(", %lu", s->verify_rx.stats.duplicate);
+			printf(", %lu", s->verify_rx.stats.out_of_order);
+			printf(", %lu", s->verify_rx.stats.late);
+		}
+		if (s->params != NULL && s->params->prbs != PRBS_NONE &&
+		    s->params->mode == U3LOOP_MODE_LOOPBACK)
+		{
+			printf(", %lu", s->prbs_rx.bits);
+			printf(", %lu", prbs_bit_errors(&s->prbs_rx));
+			printf(", %g", prbs_ber_upper_bound(&s->prbs_rx, PRBS_BER_CONFIDENCE));
+		}
+		if (s->params != NULL && s->params->telemetry) {
+			printf(", %u, 0x%04x, %u, 0x%04x",
+				s->cum_dev_errors.phy_error_cnt,
+				s->cum_dev_errors.phy_errors,
+				s->cum_dev_errors.ll_error_cnt,
+				s->cum_dev_errors.ll_errors);
+			print_volt_csv(&s->cum_volt);
+		}
+		printf("\n");
 	} else {
-		printf("\nTest Report:\n");
+		if (s->name != NULL) {
+			printf("\nTest Report: %s\n", s->name);
+		} else {
+			printf("\nTest Report:\n");
+		}
 		printf("------------\n");
 		printf("Test duration: %lu Sec.\n", total_time_usec / 1000000);
 		printf("Total operations: %llu Ops.\n", s->ops);
@@ -293,6 +961,19 @@ void print_report(struct state_t *s, bool csv)
 		printf("Average write speed: %7.2f Mbit/s\n", tx_avg_mbps);
 		printf("Average read speed:  %7.2f Mbit/s\n", rx_avg_mbps);
 		printf("\n");
+		if (s->buffers == BUF_DEV_MEM) {
+			printf("Transfer buffers: device memory, zero-copy\n");
+		} else if (s->buffers == BUF_HUGE) {
+			printf("Transfer buffers: %s, %s, NUMA node: %d, "
+				"controller NUMA node: %d\n",
+				xferbuf_pages_name(s->buf_pages),
+				s->buf_locked ? "locked" : "not locked",
+				s->buf_node, s->ctrl_node);
+		} else {
+			printf("Transfer buffers: malloc()\n");
+		}
+		printf("CPU time: %.2f Sec., %.3f Sec./GB\n", cpu_sec, cpu_per_gb);
+		printf("\n");
 		printf("Host Errors:\n");
 		printf(" - data_corrupt: %u\n", s->cum_host_errors.data_corrupt);
 		printf(" - generic:   %u\n", s->cum_host_errors.error);
@@ -300,52 +981,141 @@ void print_report(struct state_t *s, bool csv)
 		printf(" - stall:     %u\n", s->cum_host_errors.stall);
 		printf(" - timeout:   %u\n", s->cum_host_errors.timeout);
 		printf(" - overflow:  %u\n", s->cum_host_errors.overflow);
+		printf("\n");
+		if (s->params != NULL && s->params->telemetry) {
+			printf("Device Errors:\n");
+			printf(" - Physical layer errors: %u\n", s->cum_dev_errors.phy_error_cnt);
+			print_dev_phy_errors(&s->cum_dev_errors);
+			printf(" - Link layer errors: %u\n", s->cum_dev_errors.ll_error_cnt);
+			print_dev_ll_errors(&s->cum_dev_errors);
+			printf("\n");
+			printf("VBUS (mV): min: %u, mean: %.0f, max: %u, samples: %u\n",
+				s->cum_volt.min, volt_mean(&s->cum_volt),
+				s->cum_volt.max, s->cum_volt.samples);
+			printf("\n");
+		}
+		printf("Transfer latency (usec):\n");
+		if (s->cum_tx_latency.count != 0) {
+			print_latency("write", &s->cum_tx_latency);
+		}
+		if (s->cum_rx_latency.count != 0) {
+			print_latency("read ", &s->cum_rx_latency);
+		}
+		if (s->cum_ctrl_latency.count != 0) {
+			print_latency("ctrl ", &s->cum_ctrl_latency);
+		}
+		if (s->params != NULL &&
+		    (s->params->tx_rate > 0 || s->params->rx_rate > 0))
+		{
+			printf("\n");
+			printf("Paced (Mbit/s, windows of %d ms):\n", PACE_WINDOW_MS);
+			if (s->params->tx_rate > 0 && s->params->mode != U3LOOP_MODE_READ) {
+				print_pace("write", s->params->tx_rate,
+					s->ctrs.tx_bytes, total_time_usec,
+					&s->tx_pace);
+			}
+			if (s->params->rx_rate > 0 && s->params->mode != U3LOOP_MODE_WRITE) {
+				print_pace("read ", s->params->rx_rate,
+					s->ctrs.rx_bytes, total_time_usec,
+					&s->rx_pace);
+			}
+		}
+		if (s->params != NULL && s->params->ctrl_depth > 0) {
+			printf("\n");
+			printf("Control transfers: %lu, %.0f Ops/s, errors: %lu\n",
+				s->ctrs.ctrl_xfers, total_time_usec ?
+				(double) s->ctrs.ctrl_xfers * 1000000 / total_time_usec : 0,
+				s->ctrs.ctrl_errors);
+		}
+		if (s->params != NULL && s->params->ep_type == U3LOOP_EP_TYPE_ISO) {
+			printf("\n");
+			printf("Isochronous: %u bytes every %u usec. reserved, %.2f Mbit/s\n",
+				s->params->ep_bytes, s->params->ep_interval_usec,
+				(double) s->params->ep_bytes * 8 / s->params->ep_interval_usec);
+			if (s->params->mode != U3LOOP_MODE_READ) {
+				print_iso("write", s->params, &s->ctrs.tx_iso,
+					&s->tx_iso_deficit, s->ctrs.tx_bytes,
+					total_time_usec);
+			}
+			if (s->params->mode != U3LOOP_MODE_WRITE) {
+				print_iso("read ", s->params, &s->ctrs.rx_iso,
+					&s->rx_iso_deficit, s->ctrs.rx_bytes,
+					total_time_usec);
+			}
+		} else if (s->params != NULL && s->params->ep_type == U3LOOP_EP_TYPE_INT) {
+			printf("\n");
+			printf("Interrupt: %u bytes every %u usec. (jitter in usec.)\n",
+				s->params->ep_bytes, s->params->ep_interval_usec);
+			if (s->params->mode != U3LOOP_MODE_READ) {
+				printf(" - write: missed intervals: %lu, worst-case latency: %.1f usec\n",
+					s->ctrs.tx_missed, s->cum_tx_latency.max / 1000.0);
+				print_latency("write jitter", &s->tx_jitter);
+			}
+			if (s->params->mode != U3LOOP_MODE_WRITE) {
+				printf(" - read:  missed intervals: %lu, worst-case latency: %.1f usec\n",
+					s->ctrs.rx_missed, s->cum_rx_latency.max / 1000.0);
+				print_latency("read jitter ", &s->rx_jitter);
+			}
+		}
+		if (s->params != NULL && s->params->verify) {
+			printf("\n");
+			printf("Verified blocks:\n");
+			printf(" - ok:           %lu\n", s->verify_rx.stats.ok);
+			printf(" - corrupt:      %lu\n", s->verify_rx.stats.corrupt);
+			printf(" - lost:         %lu\n", s->verify_rx.stats.lost);
+			printf(" - duplicate:    %lu\n", s->verify_rx.stats.duplicate);
+			printf(" - out of order: %lu\n", s->verify_rx.stats.out_of_order);
+			printf(" - late:         %lu\n", s->verify_rx.stats.late);
+		}
+		if (s->params != NULL && s->params->prbs != PRBS_NONE &&
+		    s->params->mode == U3LOOP_MODE_LOOPBACK)
+		{
+			printf("\n");
+			prbs_print_report(s->params->prbs, &s->prbs_rx);
+		}
 	}
 }
 
-struct libusb_device_handle * open_device(char *dev_path, uint16_t vid, uint16_t pid, char *serial_number)
+/**
+ * Find serial numbers of all devices with the given vendor and product ID
+ *
+ * Devices without serial number are skipped, they can't be found again
+ * after re-enumeration.
+ *
+ * @param exclude	Serial number to skip, or NULL
+ * @returns number of serial numbers stored in serials, or -1 on error
+ */
+int list_serials(uint16_t vid, uint16_t pid, const char *exclude,
+		char **serials, int max)
 {
-	struct libusb_device_handle *dev;
 	libusb_device **devs;
 	ssize_t cnt;
+	int found = 0;
 	int i;
 	int err;
 
-	// If a device path is specified parse it.
-	uint8_t bus = 0;
-	uint8_t dev_num = 0;
-	if (dev_path != NULL) {
-		bus = strtoul(dev_path, NULL, 10);
-		dev_num = strtoul(&dev_path[4], NULL, 10);
-		// Assume both bus and dev_num start counting at 1
-		if (dev_num == 0) {
-			bus = 0;
-		}
-	}
-
 	cnt = libusb_get_device_list(NULL, &devs);
 	if (cnt < 0) {
 		fprintf(stderr, "Failed to get USB device list: %s\n",
 				libusb_error_name(cnt));
-		return NULL;
+		return -1;
 	}
 
-	bool found = false;
-	for (i=0; i < cnt && !found; i++) {
+	for (i=0; i < cnt; i++) {
 		struct libusb_device_descriptor desc;
+		struct libusb_device_handle *dev;
+		char serial_str[256];
+
 		err = libusb_get_device_descriptor(devs[i], &desc);
-		if (err != LIBUSB_SUCCESS) {
+		if (err != LIBUSB_SUCCESS ||
+		    desc.idVendor != vid || desc.idProduct != pid)
+		{
 			continue;
 		}
-
-		if (bus != 0) {
-			if (bus != libusb_get_bus_number(devs[i]) ||
-			    dev_num != libusb_get_device_address(devs[i])) {
-				continue;
-			}
-		} else if (desc.idVendor != vid ||
-			   desc.idProduct != pid)
-		{
+		if (desc.iSerialNumber == 0) {
+			fprintf(stderr, "WARNING: skipping device without serial number @ bus: %u, device: %u\n",
+					libusb_get_bus_number(devs[i]),
+					libusb_get_device_address(devs[i]));
 			continue;
 		}
 
@@ -356,140 +1126,3614 @@ struct libusb_device_handle * open_device(char *dev_path, uint16_t vid, uint16_t
 			}
 			continue;
 		}
-
-		char serial_str[256];
 		err = libusb_get_string_descriptor_ascii(dev,
 					desc.iSerialNumber,
-					(unsigned char *)serial_str,
+					(unsigned char *) serial_str,
 					sizeof(serial_str));
-		if (err == LIBUSB_SUCCESS) {
-			if (verbose) {
-				fprintf(stderr, "Unable to get serial number: %s\n", libusb_error_name(err));
-			}
-			libusb_close(dev);
+		libusb_close(dev);
+		if (err <= 0) {
 			continue;
 		}
 
-		if (serial_number == NULL ||
-				strcmp(serial_str, serial_number) == 0)
-		{
-			found = true;
-			if (verbose) {
-				printf("Found Device @ bus: %u, device: %u, s/n: %s\n",
-						       libusb_get_bus_number(devs[i]),
-						       libusb_get_device_address(devs[i]),
-						       serial_str);
-			}
-		} else {
-			libusb_close(dev);
+		if (exclude != NULL && strcmp(serial_str, exclude) == 0) {
+			continue;
+		}
+		if (found == max) {
+			fprintf(stderr, "WARNING: more than %d devices found, ignoring the rest\n", max);
+			break;
+		}
+		serials[found] = strdup(serial_str);
+		if (serials[found] == NULL) {
+			perror("strdup()");
+			break;
 		}
+		found++;
 	}
 	libusb_free_device_list(devs, 1);
 
-	if (!found) {
-		return NULL;
+	return found;
+}
+
+/**
+ * Split comma separated list in place
+ *
+ * @returns number of items, or -1 if there are more than max
+ */
+int split_list(char *list, char **items, int max)
+{
+	int cnt = 0;
+	char *item = strtok(list, ",");
+
+	while (item != NULL) {
+		if (cnt == max) {
+			return -1;
+		}
+		items[cnt++] = item;
+		item = strtok(NULL, ",");
 	}
 
-	err = libusb_claim_interface(dev, IFNUM);
-	if (err != LIBUSB_SUCCESS) {
-		fprintf(stderr, "Failed to claim device interface: %s\n",
-				libusb_error_name(err));
-		libusb_close(dev);
-		return NULL;
+	return cnt;
+}
+
+/**
+ * Initialize PassMark device configuration for a test
+ */
+void init_config(struct u3loop_config *config, int mode, int ep_type, int speed)
+{
+	struct u3loop_config dev_config = {
+		.mode = mode,
+		.ep_type = ep_type,
+		.ep_in = BULK_IN & LIBUSB_ENDPOINT_ADDRESS_MASK,
+		.ep_out = BULK_OUT & LIBUSB_ENDPOINT_ADDRESS_MASK,
+		.ss_burst_len = 0x10,
+		.polling_interval = 0x01,
+		.hs_bulk_nak_interval = 0x00,
+		.iso_transactions_per_bus_interval = 0x03,
+		.iso_bytes_per_bus_interval = htole16(0xC000), // Depends on burst length
+		.speed = speed,
+		.buffer_count = 0x02, // from USB3Test
+		.buffer_size = htole16(0xc000) // 0xc000 for read or write; 0x6000 for read and write
+	};
+	if (mode == U3LOOP_MODE_READ_WRITE) {
+		dev_config.buffer_size = htole16(0x6000);
+	} else if (mode == U3LOOP_MODE_LOOPBACK) {
+		// Same as u3loop
+		dev_config.ss_burst_len = 0x01;
+		dev_config.buffer_count = 0x40;
+		dev_config.buffer_size = htole16(0x0400);
+	}
+	if (ep_type == U3LOOP_EP_TYPE_ISO) {
+		// Max. bandwidth allowed per (micro)frame for the speed
+		if (speed == U3LOOP_SPEED_FULL) {
+			dev_config.iso_transactions_per_bus_interval = 0x01;
+			dev_config.iso_bytes_per_bus_interval = htole16(1023);
+		} else if (speed == U3LOOP_SPEED_HIGH) {
+			dev_config.iso_transactions_per_bus_interval = 0x03;
+			dev_config.iso_bytes_per_bus_interval = htole16(3 * 1024);
+		}
 	}
 
-	return dev;
+	*config = dev_config;
 }
 
-void transfer_cb(struct libusb_transfer *transfer)
+/**
+ * Prepare a configured PassMark device for testing
+ *
+ * @param lpm	Allow the device to initiate Link Power Management; if not
+ *		the link stays in U0, so LPM exit latency doesn't end up in
+ *		the measurements
+ */
+void prepare_device(struct libusb_device_handle *dev, bool lpm)
 {
-	struct state_t *state = (struct state_t *) transfer->user_data;
-	assert(state != NULL);
-	bool is_tx = ((transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT);
-	int err;
+	ssize_t len;
 
-	state->active_transfers--;
+	len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
+			U3LOOP_CMD_CONF_LPM |
+			(lpm ? U3LOOP_LPM_ENTRY_ENABLE : U3LOOP_LPM_ENTRY_DISABLE),
+			0, NULL, 0, USB_TIMEOUT);
+	if (len < LIBUSB_SUCCESS) {
+		fprintf(stderr, "Warning: Failed to set LPM entry mode: %s\n",
+				libusb_error_name(len));
+	}
 
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		state->ops++;
+	// Enable Error counters
+	struct u3loop_error_cfg err_cfg = {
+		.phy_err_mask = htole16(0x1ff),
+		.ll_err_mask = htole16(0x7fff)
+	};
+	len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
+			U3LOOP_CMD_CONF_ERROR_COUNTERS, 0,
+			(unsigned char *) &err_cfg, sizeof(err_cfg),
+			USB_TIMEOUT);
+	if (len < LIBUSB_SUCCESS) {
+		fprintf(stderr, "Warning: Unable to enable error counters:"
+				" %s\n", libusb_error_name(len));
+	}
+	len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
+			U3LOOP_CMD_RESET_ERROR_COUNTERS,
+			0, NULL, 0, USB_TIMEOUT);
+	if (len < LIBUSB_SUCCESS) {
+		fprintf(stderr, "Warning: Unable to reset error counters: "
+				"%s\n", libusb_error_name(len));
+	}
 
-		// TODO: verify data ??
-		if (transfer->length != transfer->actual_length) {
-			state->host_errors.length++;
-		}
+	// Disable LCD display during test
+	len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
+			U3LOOP_CMD_SET_DISPLAY_MODE | U3LOOP_DISPLAY_DISABLE,
+			0, NULL, 0, USB_TIMEOUT);
+	if (len < LIBUSB_SUCCESS) {
+		fprintf(stderr, "Warning: Failed to set display mode: %s\n",
+				libusb_error_name(len));
+	}
+}
 
-		if (is_tx) {
-			state->ctrs.tx_bytes += transfer->actual_length;
-		} else {
-			state->ctrs.rx_bytes += transfer->actual_length;
-		}
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-		state->host_errors.error++;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		state->host_errors.timeout++;
+/**
+ * Probe and configure a PassMark device
+ *
+ * With speed 0 the fastest speed supported by the device and its port is
+ * selected. If the link comes up slower, the port is the limit, and the
+ * device is configured again for the link speed, so the endpoint parameters
+ * match. The configuration used is stored in config.
+ *
+ * @returns new device handle, or NULL on error, in which case dev is closed
+ */
+struct libusb_device_handle *setup_device(struct libusb_device_handle *dev,
+		struct u3loop_config *config, int mode, int ep_type, int speed,
+		uint8_t poll_interval, uint16_t vid, uint16_t pid,
+		char *serial_number, const char *name, bool quiet)
+{
+	struct u3dev_caps caps;
+	bool auto_speed = (speed == 0);
+	int attempt;
+
+	u3dev_probe(dev, &caps);
+	if (auto_speed) {
+		speed = u3dev_select_speed(&caps);
+	}
+
+	for (attempt=0; attempt < 2; attempt++) {
+		uint64_t reenum_usec = 0;
+
+		init_config(config, mode, ep_type, speed);
+		if (poll_interval != 0) {
+			config->polling_interval = poll_interval;
+		}
+		dev = u3dev_configure(dev, config, vid, pid, serial_number,
+				&reenum_usec);
+		if (dev == NULL) {
+			return NULL;
+		}
+		if (!quiet && reenum_usec != 0) {
+			printf("Device re-enumerated in %.3f Sec.\n",
+					reenum_usec / 1000000.0);
+		}
+
+		caps.link_speed = u3dev_link_speed(dev);
+		if (!auto_speed || caps.link_speed == 0 ||
+		    caps.link_speed >= speed)
+		{
+			break;
+		}
+		speed = caps.link_speed;
+	}
+
+	if (!quiet) {
+		if (name != NULL) {
+			printf("%s: ", name);
+		}
+		printf("Device configuration: speed: %s (%s, max.: %s, link: %s), "
+			"burst: %u, buffers: %u x %u, firmware: %x.%02x\n",
+			u3dev_speed_name(config->speed), auto_speed ? "auto" : "forced",
+			caps.max_speed ? u3dev_speed_name(caps.max_speed) : "unknown",
+			u3dev_speed_name(caps.link_speed), config->ss_burst_len,
+			config->buffer_count, le16toh(config->buffer_size),
+			caps.firmware >> 8, caps.firmware & 0xff);
+	}
+	if (verbose && caps.info_len > 0) {
+		int i;
+
+		printf("Device info:");
+		for (i=0; i < caps.info_len; i++) {
+			printf(" %02x", caps.info[i]);
+		}
+		printf("\n");
+	}
+
+	return dev;
+}
+
+/**
+ * Get the bandwidth reserved for an isochronous or interrupt endpoint
+ *
+ * Selects the alternate setting of the interface that contains the endpoint.
+ *
+ * @param bytes		Returns bytes per service interval
+ * @param interval_usec	Returns service interval length
+ * @returns 0 on success, -1 on error
+ */
+int get_periodic_endpoint(struct libusb_device_handle *dev, uint8_t ep,
+		unsigned int *bytes, unsigned int *interval_usec)
+{
+	libusb_device *udev = libusb_get_device(dev);
+	struct libusb_config_descriptor *config;
+	const struct libusb_endpoint_descriptor *ep_desc = NULL;
+	int alt = 0;
+	int retval = -1;
+	int err;
+	int i, j;
+
+	err = libusb_get_active_config_descriptor(udev, &config);
+	if (err != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Failed to get configuration descriptor: %s\n",
+				libusb_error_name(err));
+		return -1;
+	}
+
+	if (IFNUM < config->bNumInterfaces) {
+		const struct libusb_interface *intf = &config->interface[IFNUM];
+		for (i=0; i < intf->num_altsetting && ep_desc == NULL; i++) {
+			const struct libusb_interface_descriptor *as = &intf->altsetting[i];
+			for (j=0; j < as->bNumEndpoints; j++) {
+				if (as->endpoint[j].bEndpointAddress == ep) {
+					ep_desc = &as->endpoint[j];
+					alt = as->bAlternateSetting;
+					break;
+				}
+			}
+		}
+	}
+	int type = -1;
+	if (ep_desc != NULL) {
+		type = ep_desc->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+	}
+	if (type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS &&
+	    type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+	{
+		fprintf(stderr, "Endpoint 0x%02x is not a periodic endpoint\n", ep);
+		goto fail;
+	}
+
+	// wMaxPacketSize bits 12..11 are additional transactions per
+	// microframe; for SuperSpeed the companion descriptor has burst and mult
+	int speed = libusb_get_device_speed(udev);
+	unsigned int mult = ((ep_desc->wMaxPacketSize >> 11) & 0x3) + 1;
+	if (speed >= LIBUSB_SPEED_SUPER) {
+		struct libusb_ss_endpoint_companion_descriptor *comp;
+		mult = 1;
+		err = libusb_get_ss_endpoint_companion_descriptor(NULL, ep_desc, &comp);
+		if (err == LIBUSB_SUCCESS) {
+			mult = (comp->bMaxBurst + 1) * ((comp->bmAttributes & 0x3) + 1);
+			libusb_free_ss_endpoint_companion_descriptor(comp);
+		}
+	}
+	*bytes = (ep_desc->wMaxPacketSize & 0x7ff) * mult;
+
+	// Interval is 2^(bInterval-1) (micro)frames, except for Full Speed
+	// interrupt endpoints where it is bInterval frames
+	if (speed < LIBUSB_SPEED_HIGH && type == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+		*interval_usec = 1000 * (ep_desc->bInterval ? ep_desc->bInterval : 1);
+	} else {
+		unsigned int exp = ep_desc->bInterval;
+		if (exp < 1) exp = 1;
+		if (exp > 16) exp = 16;
+		*interval_usec = (speed >= LIBUSB_SPEED_HIGH ? 125 : 1000) << (exp - 1);
+	}
+
+	if (alt != 0) {
+		err = libusb_set_interface_alt_setting(dev, IFNUM, alt);
+		if (err != LIBUSB_SUCCESS) {
+			fprintf(stderr, "Failed to select alternate setting %d: %s\n",
+					alt, libusb_error_name(err));
+			goto fail;
+		}
+	}
+
+	if (verbose) {
+		printf("%s endpoint 0x%02x: %u bytes every %u usec.\n",
+				type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ? "Iso." : "Interrupt",
+				ep, *bytes, *interval_usec);
+	}
+
+	retval = 0;
+fail:
+	libusb_free_config_descriptor(config);
+	return retval;
+}
+
+/**
+ * Submit transfer and record submit time
+ */
+int submit_transfer(struct libusb_transfer *transfer)
+{
+	struct xfer_ctx *ctx = (struct xfer_ctx *) transfer->user_data;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &ctx->submit_time);
+
+	err = libusb_submit_transfer(transfer);
+	if (err == LIBUSB_SUCCESS) {
+		ctx->state->active_transfers++;
+	}
+
+	return err;
+}
+
+/**
+ * Set up pacer of one direction
+ *
+ * @param mbps		Target rate in Mbit/s, 0 to disable pacing
+ * @param xfer_size	Size of the paced transfers
+ * @param xfer_cnt	Max. transfers that can be parked
+ *
+ * @returns 0 on success, -1 on error
+ */
+int pacer_init(struct pacer *pacer, double mbps, size_t xfer_size,
+		unsigned int xfer_cnt, const struct timespec *now)
+{
+	memset(pacer, 0, sizeof(*pacer));
+	if (mbps <= 0) {
+		return 0;
+	}
+
+	pacer->parked = calloc(xfer_cnt, sizeof(*pacer->parked));
+	if (pacer->parked == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+	pacer->parked_size = xfer_cnt;
+
+	pacer->rate = mbps / 8000;
+	// Allow for a late event thread, but always fit two transfers
+	pacer->burst = pacer->rate * PACE_BURST_US * 1000;
+	if (pacer->burst < 2.0 * xfer_size) {
+		pacer->burst = 2.0 * xfer_size;
+	}
+	pacer->tokens = pacer->burst;
+	pacer->last = *now;
+	pacer->window_start = *now;
+
+	return 0;
+}
+
+void pacer_free(struct pacer *pacer)
+{
+	free(pacer->parked);
+	memset(pacer, 0, sizeof(*pacer));
+}
+
+/**
+ * Take tokens to submit a transfer of len bytes
+ *
+ * @returns true if the transfer may be submitted now
+ */
+bool pacer_take(struct pacer *pacer, size_t len, const struct timespec *now)
+{
+	double nsec = (now->tv_sec - pacer->last.tv_sec) * 1e9 +
+			(now->tv_nsec - pacer->last.tv_nsec);
+
+	if (nsec > 0) {
+		pacer->tokens += pacer->rate * nsec;
+		if (pacer->tokens > pacer->burst) {
+			pacer->tokens = pacer->burst;
+		}
+		pacer->last = *now;
+	}
+
+	if (pacer->tokens < len) {
+		return false;
+	}
+	pacer->tokens -= len;
+
+	return true;
+}
+
+/**
+ * Queue a transfer until the pacer has tokens for it
+ *
+ * Parked transfers are submitted in the order they were parked, so
+ * sequence stamped and PRBS data leaves in the order it was generated.
+ */
+void pacer_park(struct pacer *pacer, struct libusb_transfer *transfer)
+{
+	assert(pacer->parked_cnt < pacer->parked_size);
+	pacer->parked[(pacer->parked_head + pacer->parked_cnt) %
+			pacer->parked_size] = transfer;
+	pacer->parked_cnt++;
+}
+
+/**
+ * Start a new shortfall window, e.g. after statistics were restarted
+ */
+void pacer_restart(struct pacer *pacer, const struct timespec *now)
+{
+	pacer->window_bytes = 0;
+	pacer->window_start = *now;
+}
+
+/**
+ * Submit parked transfers the pacer has tokens for, and close the shortfall
+ * window if it has passed
+ *
+ * @returns 0 on success, -1 if a transfer could not be submitted
+ */
+int pacer_service(struct pacer *pacer, struct pace_stats *stats,
+		const struct timespec *now)
+{
+	struct libusb_transfer *transfer;
+	int err;
+
+	if (pacer->rate == 0) {
+		return 0;
+	}
+
+	while (pacer->parked_cnt > 0) {
+		transfer = pacer->parked[pacer->parked_head];
+		if (!pacer_take(pacer, transfer->length, now)) {
+			break;
+		}
+		pacer->parked_head = (pacer->parked_head + 1) % pacer->parked_size;
+		pacer->parked_cnt--;
+
+		err = submit_transfer(transfer);
+		if (err != LIBUSB_SUCCESS) {
+			fprintf(stderr, "Failed to submit transfer: %s\n", libusb_strerror(err));
+			return -1;
+		}
+	}
+
+	uint64_t usec = elapsed_usec(&pacer->window_start, now);
+	if (usec >= PACE_WINDOW_MS * 1000ull) {
+		double target = pacer->rate * usec * 1000;
+		double shortfall = (target - pacer->window_bytes) * 100 / target;
+
+		stats->windows++;
+		if (shortfall > PACE_SHORT_PCT) {
+			stats->short_windows++;
+		}
+		if (shortfall > stats->max_shortfall) {
+			stats->max_shortfall = shortfall;
+		}
+		pacer_restart(pacer, now);
+	}
+
+	return 0;
+}
+
+/**
+ * Account the packets of a completed isochronous transfer
+ *
+ * Every packet occupies one service interval, so a lost or short packet is
+ * bandwidth that was reserved but not delivered.
+ */
+void iso_complete(struct state_t *state, struct libusb_transfer *transfer,
+		bool is_tx)
+{
+	struct iso_counters *c = is_tx ? &state->ctrs.tx_iso : &state->ctrs.rx_iso;
+	uint64_t bytes = 0;
+	int i;
+
+	for (i=0; i < transfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *pkt = &transfer->iso_packet_desc[i];
+		unsigned int actual = 0;
+
+		if (pkt->status == LIBUSB_TRANSFER_COMPLETED) {
+			actual = pkt->actual_length;
+			if (actual < pkt->length) {
+				c->short_packets++;
+			}
+		} else {
+			c->lost++;
+		}
+		bytes += actual;
+		hist_record(is_tx ? &state->tx_iso_deficit : &state->rx_iso_deficit,
+				pkt->length - actual);
+	}
+	c->packets += transfer->num_iso_packets;
+
+	if (is_tx) {
+		state->ctrs.tx_bytes += bytes;
+		state->ctrs.tx_xfers++;
+	} else {
+		state->ctrs.rx_bytes += bytes;
+		state->ctrs.rx_xfers++;
+	}
+}
+
+/**
+ * Account the interval between completions of interrupt transfers
+ *
+ * The distance to the nearest multiple of the service interval is recorded as
+ * jitter, and every multiple skipped as a missed service interval.
+ */
+void interrupt_complete(struct state_t *state, bool is_tx,
+		const struct timespec *now)
+{
+	struct timespec *last = is_tx ? &state->tx_last_completion : &state->rx_last_completion;
+	uint64_t interval = state->params->ep_interval_usec * 1000ull;
+
+	if (last->tv_sec != 0 || last->tv_nsec != 0) {
+		uint64_t delta = (now->tv_sec - last->tv_sec) * 1000000000ull +
+				now->tv_nsec - last->tv_nsec;
+		uint64_t n = (delta + interval / 2) / interval;
+		if (n == 0) n = 1;
+
+		uint64_t jitter = (delta > n * interval) ?
+				delta - n * interval : n * interval - delta;
+		if (is_tx) {
+			hist_record(&state->tx_jitter, jitter);
+			state->ctrs.tx_missed += n - 1;
+		} else {
+			hist_record(&state->rx_jitter, jitter);
+			state->ctrs.rx_missed += n - 1;
+		}
+	}
+	*last = *now;
+}
+
+/**
+ * Account the data of a completed bulk or interrupt transfer
+ */
+void data_complete(struct state_t *state, bool is_tx, const uint8_t *buf,
+		int length, int actual_length)
+{
+	if (length != actual_length) {
+		state->host_errors.length++;
+	}
+
+	if (!is_tx && state->params->verify) {
+		if (u3verify_check(&state->verify_rx, buf,
+				actual_length) == U3VERIFY_CORRUPT)
+		{
+			state->host_errors.data_corrupt++;
+		}
+	} else if (!is_tx && state->params->prbs != PRBS_NONE &&
+			state->params->mode == U3LOOP_MODE_LOOPBACK)
+	{
+		uint64_t syndrome = state->prbs_rx.syndrome;
+		prbs_check(state->params->prbs, buf, actual_length,
+				&state->prbs_rx);
+		if (state->prbs_rx.syndrome != syndrome) {
+			state->host_errors.data_corrupt++;
+		}
+	}
+
+	if (is_tx) {
+		state->ctrs.tx_bytes += actual_length;
+		state->ctrs.tx_xfers++;
+	} else {
+		state->ctrs.rx_bytes += actual_length;
+		state->ctrs.rx_xfers++;
+	}
+}
+
+/**
+ * Finish a telemetry sample
+ *
+ * @returns sampled data of len bytes, or NULL if the sample failed
+ */
+const uint8_t *sampler_data(struct libusb_transfer *transfer, size_t len)
+{
+	struct sampler *s = (struct sampler *) transfer->user_data;
+
+	s->busy = false;
+
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		return NULL;
+	} else if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		fprintf(stderr, "Warning: Unable to obtain %s: %s\n", s->what,
+				libusb_error_name(transfer->status));
+		s->failed = true;
+		return NULL;
+	} else if ((size_t) transfer->actual_length != len) {
+		fprintf(stderr, "Warning: Unable to obtain %s: "
+				"incorrect size data returned\n", s->what);
+		s->failed = true;
+		return NULL;
+	}
+
+	return libusb_control_transfer_get_data(transfer);
+}
+
+void err_sample_cb(struct libusb_transfer *transfer)
+{
+	struct sampler *s = (struct sampler *) transfer->user_data;
+	const struct u3loop_errors *ec;
+
+	ec = (const struct u3loop_errors *) sampler_data(transfer, sizeof(*ec));
+	if (ec == NULL) {
+		return;
+	}
+
+	s->state->dev_errors.phy_error_cnt += le32toh(ec->phy_error_cnt);
+	s->state->dev_errors.phy_errors    |= le32toh(ec->phy_errors);
+	s->state->dev_errors.ll_error_cnt  += le32toh(ec->ll_error_cnt);
+	s->state->dev_errors.ll_errors     |= le32toh(ec->ll_errors);
+}
+
+void volt_sample_cb(struct libusb_transfer *transfer)
+{
+	struct sampler *s = (struct sampler *) transfer->user_data;
+	const struct u3loop_voltage *v;
+
+	v = (const struct u3loop_voltage *) sampler_data(transfer, sizeof(*v));
+	if (v == NULL) {
+		return;
+	}
+
+	volt_record(&s->state->volt, le16toh(v->vbus));
+	volt_record(&s->state->cum_volt, le16toh(v->vbus));
+}
+
+/**
+ * Allocate the transfer of a telemetry read request
+ *
+ * @param what	Description of the data for warnings
+ * @param cmd	Vendor command, wValue of the request
+ * @param len	Size of the data returned by the device
+ * @param cb	Transfer callback, processing the data
+ *
+ * @returns 0 on success, -1 on error
+ */
+int sampler_init(struct sampler *s, struct libusb_device_handle *dev,
+		struct state_t *state, const char *what, uint16_t cmd,
+		uint16_t len, libusb_transfer_cb_fn cb)
+{
+	uint8_t *buf;
+
+	memset(s, 0, sizeof(*s));
+	s->state = state;
+	s->what = what;
+
+	buf = (uint8_t *) malloc(LIBUSB_CONTROL_SETUP_SIZE + len);
+	s->xfer = libusb_alloc_transfer(0);
+	if (buf == NULL || s->xfer == NULL) {
+		fprintf(stderr, "Failed to allocate %s transfer\n", what);
+		free(buf);
+		libusb_free_transfer(s->xfer);
+		s->xfer = NULL;
+		return -1;
+	}
+
+	libusb_fill_control_setup(buf,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 0,
+			cmd, 0, len);
+	libusb_fill_control_transfer(s->xfer, dev, buf, cb, s, USB_TIMEOUT);
+	s->xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+	return 0;
+}
+
+/**
+ * Submit the next sample if it is due and the previous one has completed
+ *
+ * Samples are read over the control endpoint, next to the queued bulk
+ * transfers, instead of stopping the data flow like a synchronous request.
+ */
+void sampler_service(struct sampler *s, const struct timespec *now)
+{
+	int err;
+
+	if (s->xfer == NULL || s->busy || s->failed ||
+	    elapsed_usec(&s->last, now) < SAMPLE_MS * 1000ull)
+	{
+		return;
+	}
+
+	s->last = *now;
+	err = libusb_submit_transfer(s->xfer);
+	if (err != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Warning: Unable to obtain %s: %s\n", s->what,
+				libusb_error_name(err));
+		s->failed = true;
+		return;
+	}
+	s->busy = true;
+}
+
+/**
+ * Cancel an outstanding sample and free the transfer
+ */
+void sampler_free(struct sampler *s)
+{
+	if (s->xfer == NULL) {
+		return;
+	}
+
+	if (s->busy) {
+		libusb_cancel_transfer(s->xfer);
+	}
+	while (s->busy) {
+		libusb_handle_events(NULL);
+	}
+
+	libusb_free_transfer(s->xfer);
+	s->xfer = NULL;
+}
+
+void transfer_cb(struct libusb_transfer *transfer)
+{
+	struct xfer_ctx *ctx = (struct xfer_ctx *) transfer->user_data;
+	assert(ctx != NULL);
+	struct state_t *state = ctx->state;
+	bool is_ctrl = (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL);
+	bool is_tx = (!is_ctrl &&
+		(transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT);
+	struct timespec now;
+	uint64_t latency;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	state->active_transfers--;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		latency = (now.tv_sec - ctx->submit_time.tv_sec) * 1000000000ull +
+				now.tv_nsec - ctx->submit_time.tv_nsec;
+		ctx->latency = latency;
+		if (is_ctrl) {
+			hist_record(&state->ctrl_latency, latency);
+			hist_record(&state->cum_ctrl_latency, latency);
+			state->ctrs.ctrl_xfers++;
+			break;
+		}
+
+		state->ops++;
+		if (is_tx) {
+			hist_record(&state->tx_latency, latency);
+			hist_record(&state->cum_tx_latency, latency);
+		} else {
+			hist_record(&state->rx_latency, latency);
+			hist_record(&state->cum_rx_latency, latency);
+		}
+
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+			iso_complete(state, transfer, is_tx);
+			break;
+		} else if (transfer->type == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+			interrupt_complete(state, is_tx, &now);
+		}
+
+		data_complete(state, is_tx, transfer->buffer, transfer->length,
+				transfer->actual_length);
+		if (ctx->pacer != NULL) {
+			ctx->pacer->window_bytes += transfer->actual_length;
+		}
+		break;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_STALL:
+	case LIBUSB_TRANSFER_OVERFLOW:
+		// Host errors are for data transfers only
+		if (is_ctrl) {
+			state->ctrs.ctrl_errors++;
+		} else if (transfer->status == LIBUSB_TRANSFER_ERROR) {
+			state->host_errors.error++;
+		} else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+			state->host_errors.timeout++;
+		} else if (transfer->status == LIBUSB_TRANSFER_STALL) {
+			state->host_errors.stall++;
+		} else {
+			state->host_errors.overflow++;
+		}
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		fprintf(stderr, "Device disconnected\n");
+		terminate = true;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return; // Stop on cancellation of transfer
+	default:
+		assert(false);
+	}
+
+	if (!terminate && !state->stopping) {
+		if (is_tx && state->params->verify) {
+			u3verify_fill(&state->verify_tx, transfer->buffer,
+					transfer->length);
+		} else if (is_tx && state->params->prbs != PRBS_NONE) {
+			prbs_fill(&state->prbs_tx, transfer->buffer,
+					transfer->length);
+		}
+
+		if (state->params->gap_cnt > 0) {
+			// Resubmitted by run_burst_test() after the next gap
+			return;
+		}
+
+		// Older parked transfers go first; only pacer_service() drains
+		// the queue, so data leaves in the order it was generated.
+		if (ctx->pacer != NULL && (ctx->pacer->parked_cnt > 0 ||
+		    !pacer_take(ctx->pacer, transfer->length, &now)))
+		{
+			pacer_park(ctx->pacer, transfer);
+			return;
+		}
+
+		err = submit_transfer(transfer);
+		if (err != LIBUSB_SUCCESS) {
+			fprintf(stderr, "Failed to submit transfer: %s\n", libusb_strerror(err));
+		}
+	}
+}
+
+void load_cb(struct libusb_transfer *transfer)
+{
+	struct bulk_load *load = (struct bulk_load *) transfer->user_data;
+	int err;
+
+	load->active_transfers--;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		load->bytes += transfer->actual_length;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		fprintf(stderr, "Load device disconnected\n");
+		return;
+	default:
+		// Load is best effort, only the measured device counts errors
+		break;
+	}
+
+	if (!terminate && !load->stopping) {
+		err = libusb_submit_transfer(transfer);
+		if (err == LIBUSB_SUCCESS) {
+			load->active_transfers++;
+		} else {
+			fprintf(stderr, "Failed to submit load transfer: %s\n",
+					libusb_strerror(err));
+		}
+	}
+}
+
+/**
+ * Start bulk reads and writes on the load device
+ *
+ * @returns 0 on success, -1 on error
+ */
+int start_load(struct bulk_load *load)
+{
+	int err;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &load->start_time);
+
+	for (i=0; i < LOAD_QUEUE_DEPTH; i++) {
+		load->xfers[i] = libusb_alloc_transfer(0);
+		if (load->xfers[i] == NULL) {
+			fprintf(stderr, "Failed to allocate transfer\n");
+			return -1;
+		}
+
+		uint8_t *buf = (uint8_t *) malloc(DEFAULT_TRANSFER_SIZE);
+		if (buf == NULL) {
+			perror("malloc()");
+			return -1;
+		}
+		memset(buf, 0xC5, DEFAULT_TRANSFER_SIZE);
+
+		libusb_fill_bulk_transfer(load->xfers[i], load->dev,
+				(i & 1) ? BULK_OUT : BULK_IN, buf,
+				DEFAULT_TRANSFER_SIZE, load_cb, load, USB_TIMEOUT);
+
+		err = libusb_submit_transfer(load->xfers[i]);
+		if (err != LIBUSB_SUCCESS) {
+			fprintf(stderr, "Failed to submit load transfer: %s\n",
+					libusb_strerror(err));
+			return -1;
+		}
+		load->active_transfers++;
+	}
+
+	return 0;
+}
+
+/**
+ * Cancel and free all transfers of the load device
+ */
+void stop_load(struct bulk_load *load)
+{
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &load->stop_time);
+
+	load->stopping = true;
+	for (i=0; i < LOAD_QUEUE_DEPTH; i++) {
+		if (load->xfers[i] != NULL) {
+			libusb_cancel_transfer(load->xfers[i]);
+		}
+	}
+	// TODO: add timeout
+	while (load->active_transfers != 0) {
+		libusb_handle_events(NULL);
+	}
+
+	for (i=0; i < LOAD_QUEUE_DEPTH; i++) {
+		if (load->xfers[i] == NULL) continue;
+		free(load->xfers[i]->buffer);
+		libusb_free_transfer(load->xfers[i]);
+		load->xfers[i] = NULL;
+	}
+}
+
+/**
+ * Clear all statistics and restart measuring at time now
+ *
+ * Keeps track of submitted transfers and data stream state.
+ */
+void restart_statistics(struct state_t *state, const struct timespec *now)
+{
+	struct state_t old = *state;
+
+	memset(state, 0, sizeof(*state));
+	state->params = old.params;
+	state->name = old.name;
+	state->buffers = old.buffers;
+	state->buf_pages = old.buf_pages;
+	state->buf_locked = old.buf_locked;
+	state->buf_node = old.buf_node;
+	state->ctrl_node = old.ctrl_node;
+	state->active_transfers = old.active_transfers;
+	state->verify_tx = old.verify_tx;
+	state->verify_rx = old.verify_rx;
+	memset(&state->verify_rx.stats, 0, sizeof(state->verify_rx.stats));
+	state->prbs_tx = old.prbs_tx;
+
+	state->start_time = *now;
+	state->measurement_time = *now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &state->cpu_start);
+}
+
+/**
+ * Cancel and free all transfers of a test on one device
+ */
+void stop_run(struct test_run *run)
+{
+	struct state_t *state = run->state;
+	unsigned int i;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &(state->stop_time)) == -1) {
+		perror("clock_gettime");
+	}
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &state->cpu_stop);
+
+	// Cancel all submitted transfers
+	state->stopping = true;
+	for (i=0; i < run->xfer_cnt; i++) {
+		if (run->xfers[i] != NULL) {
+			libusb_cancel_transfer(run->xfers[i]);
+		}
+	}
+	// TODO: add timeout
+	while (state->active_transfers != 0) {
+		libusb_handle_events(NULL);
+	}
+	sampler_free(&run->errs);
+	sampler_free(&run->volt);
+	fold_errors(state);
+	if (state->params->verify) {
+		u3verify_rx_finish(&state->verify_rx);
+	}
+
+	// Free transfers
+	for (i=0; i < run->xfer_cnt; i++) {
+		if (run->xfers[i] == NULL) continue;
+		if (run->xfers[i]->buffer == NULL) continue;
+
+#if LIBUSB_API_VERSION >= 0x01000105
+		if (run->ctxs[i].dev_mem) {
+			libusb_dev_mem_free(run->dev, run->xfers[i]->buffer,
+					run->xfers[i]->length);
+		} else
+#endif // LIBUSB_API_VERSION >= 0x01000105
+		if (run->pool.base == NULL) {
+			free(run->xfers[i]->buffer);
+		}
+
+		libusb_free_transfer(run->xfers[i]);
+	}
+	xferbuf_destroy(&run->pool);
+	pacer_free(&run->tx_pacer);
+	pacer_free(&run->rx_pacer);
+
+	free(run->xfers);
+	free(run->ctxs);
+	run->xfers = NULL;
+	run->ctxs = NULL;
+	run->xfer_cnt = 0;
+}
+
+/**
+ * Allocate and submit the transfers of a test on one device
+ *
+ * Statistics are collected in run->state, which is reset. On error all
+ * transfers are stopped again.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int start_run(struct test_run *run, const struct test_params *p)
+{
+	struct libusb_device_handle *dev = run->dev;
+	struct state_t *state = run->state;
+	struct libusb_transfer **xfers;
+	struct xfer_ctx *ctxs;
+	unsigned int xfer_cnt;
+	unsigned int bulk_cnt;
+	size_t xfer_size = p->transfer_size;
+	int iso_packets = 0;
+	unsigned int in_left = 0;
+	unsigned int out_left = 0;
+	int err;
+	unsigned int i;
+
+	if (p->mode != U3LOOP_MODE_WRITE) {
+		in_left = p->depth_in;
+	}
+	if (p->mode != U3LOOP_MODE_READ) {
+		out_left = p->depth_out;
+	}
+	bulk_cnt = in_left + out_left;
+	xfer_cnt = bulk_cnt + p->ctrl_depth;
+	if (xfer_cnt == 0) {
+		fprintf(stderr, "Queue depth must be at least 1\n");
+		return -1;
+	}
+	if (p->ep_type == U3LOOP_EP_TYPE_ISO) {
+		iso_packets = p->iso_packets;
+		xfer_size = (size_t) p->iso_packets * p->ep_bytes;
+	} else if (p->ep_type == U3LOOP_EP_TYPE_INT) {
+		// Complete every transfer in a single service interval
+		xfer_size = p->ep_bytes;
+	}
+
+	xfers = calloc(xfer_cnt, sizeof(*xfers));
+	ctxs = calloc(xfer_cnt, sizeof(*ctxs));
+	if (xfers == NULL || ctxs == NULL) {
+		perror("calloc()");
+		free(xfers);
+		free(ctxs);
+		return -1;
+	}
+	run->xfers = xfers;
+	run->ctxs = ctxs;
+	run->xfer_cnt = xfer_cnt;
+	memset(&run->tx_pacer, 0, sizeof(run->tx_pacer));
+	memset(&run->rx_pacer, 0, sizeof(run->rx_pacer));
+	memset(&run->errs, 0, sizeof(run->errs));
+	memset(&run->volt, 0, sizeof(run->volt));
+
+	const char *name = state->name;
+	memset(state, 0, sizeof(*state));
+	state->params = p;
+	state->name = name;
+	if (p->verify) {
+		uint32_t run_id = u3verify_run_id();
+		u3verify_tx_init(&state->verify_tx, run_id);
+		u3verify_rx_init(&state->verify_rx, run_id);
+	}
+	prbs_init(&state->prbs_tx, p->prbs);
+
+	switch (p->buffers) {
+	case BUF_DEV_MEM:
+#if LIBUSB_API_VERSION < 0x01000105
+		fprintf(stderr, "Device memory requires libusb 1.0.21 or newer\n");
+		goto fail;
+#endif // LIBUSB_API_VERSION < 0x01000105
+		run->use_dev_mem = 1;
+		break;
+	case BUF_MALLOC:
+		run->use_dev_mem = 0;
+		break;
+	case BUF_HUGE:
+		run->use_dev_mem = 0;
+		state->ctrl_node = xferbuf_bus_node(
+				libusb_get_bus_number(libusb_get_device(dev)));
+
+		size_t ctrl_size = LIBUSB_CONTROL_SETUP_SIZE + p->ctrl_setup.wLength;
+		size_t pool_size =
+			bulk_cnt * ((xfer_size + XFERBUF_ALIGN - 1) & ~(XFERBUF_ALIGN - 1)) +
+			p->ctrl_depth * ((ctrl_size + XFERBUF_ALIGN - 1) & ~(XFERBUF_ALIGN - 1));
+		if (xferbuf_init(&run->pool, pool_size, state->ctrl_node) != 0) {
+			goto fail;
+		}
+		state->buf_pages = run->pool.pages;
+		state->buf_locked = run->pool.locked;
+		state->buf_node = run->pool.node;
+		if (!run->pool.locked) {
+			fprintf(stderr, "WARNING: unable to lock transfer buffers, "
+					"check RLIMIT_MEMLOCK\n");
+		}
+		if (state->ctrl_node >= 0 && run->pool.node != state->ctrl_node) {
+			fprintf(stderr, "WARNING: transfer buffers on NUMA node %d, "
+					"host controller on node %d\n",
+					run->pool.node, state->ctrl_node);
+		}
+		break;
+	default:
+		run->use_dev_mem = -1;
+		break;
+	}
+
+	// Get start time
+	if (clock_gettime(CLOCK_MONOTONIC, &(state->start_time)) == -1) {
+		perror("clock_gettime");
+		goto fail;
+	}
+	state->measurement_time = state->start_time;
+
+	if (pacer_init(&run->tx_pacer, p->tx_rate, xfer_size, bulk_cnt,
+				&state->start_time) != 0 ||
+	    pacer_init(&run->rx_pacer, p->rx_rate, xfer_size, bulk_cnt,
+				&state->start_time) != 0)
+	{
+		goto fail;
+	}
+	if (p->telemetry &&
+	    (sampler_init(&run->errs, dev, state, "error counters",
+			U3LOOP_CMD_GET_ERROR_COUNTERS,
+			sizeof(struct u3loop_errors), err_sample_cb) != 0 ||
+	     sampler_init(&run->volt, dev, state, "voltage",
+			U3LOOP_CMD_GET_VOLTAGE,
+			sizeof(struct u3loop_voltage), volt_sample_cb) != 0))
+	{
+		goto fail;
+	}
+
+	// Allocate and submit USB transfers
+	for (i=0; i < xfer_cnt; i++) {
+		xfers[i] = libusb_alloc_transfer(iso_packets);
+		if (xfers[i] == NULL) {
+			fprintf(stderr, "Failed to allocate transfer\n");
+			goto fail;
+		}
+
+		size_t buf_size = xfer_size;
+		if (i >= bulk_cnt) {
+			buf_size = LIBUSB_CONTROL_SETUP_SIZE + p->ctrl_setup.wLength;
+		}
+
+		uint8_t *buf = NULL;
+#if LIBUSB_API_VERSION >= 0x01000105
+		if (run->use_dev_mem) {
+			buf = (uint8_t *) libusb_dev_mem_alloc(dev, buf_size);
+			if (buf == NULL) {
+				if (run->use_dev_mem == -1) {
+					// If first time allocation fails then
+					// DMA is probably not supported on
+					// this platform. So disable.
+					if (verbose) printf("DMA not supported,"
+						" using malloc() instead\n");
+					run->use_dev_mem = 0;
+				} else if (p->buffers == BUF_AUTO) {
+					// Device memory ran out, e.g. because
+					// of the usbfs memory limit
+					if (verbose) printf("DMA memory exhausted,"
+						" using malloc() for remaining"
+						" buffers\n");
+					run->use_dev_mem = 0;
+				} else {
+					fprintf(stderr, "Failed to allocate "
+							"DMA buffer\n");
+					libusb_free_transfer(xfers[i]);
+					xfers[i] = NULL;
+					goto fail;
+				}
+			} else if (run->use_dev_mem == -1) {
+				if (verbose) printf("DMA supported, using "
+						"libusb_dev_mem_alloc()\n");
+				run->use_dev_mem = 1;
+			}
+			ctxs[i].dev_mem = (buf != NULL);
+		}
+#endif // LIBUSB_API_VERSION >= 0x01000105
+
+		if (run->pool.base != NULL) {
+			buf = (uint8_t *) xferbuf_alloc(&run->pool, buf_size);
+			if (buf == NULL) {
+				fprintf(stderr, "Transfer buffer pool exhausted\n");
+				libusb_free_transfer(xfers[i]);
+				xfers[i] = NULL;
+				goto fail;
+			}
+		}
+
+		if (buf == NULL) {
+			buf = (uint8_t *) malloc(buf_size);
+			if (buf == NULL) {
+				perror("malloc()");
+				libusb_free_transfer(xfers[i]);
+				xfers[i] = NULL;
+				goto fail;
+			}
+		}
+
+		ctxs[i].state = state;
+
+		if (i >= bulk_cnt) {
+			// Control transfers come after all bulk transfers
+			libusb_fill_control_setup(buf, p->ctrl_setup.bmRequestType,
+					p->ctrl_setup.bRequest, p->ctrl_setup.wValue,
+					p->ctrl_setup.wIndex, p->ctrl_setup.wLength);
+			libusb_fill_control_transfer(xfers[i], dev, buf,
+					transfer_cb, &ctxs[i], USB_TIMEOUT);
+
+			err = submit_transfer(xfers[i]);
+			if (err != LIBUSB_SUCCESS) {
+				fprintf(stderr, "Failed to submit transfer: %s\n", libusb_strerror(err));
+				goto fail;
+			}
+			continue;
+		}
+
+		// Determine endpoint, alternate while both directions have
+		// transfers left.
+		int ep;
+		if (in_left > 0 && (out_left == 0 || (i & 1) == 0)) {
+			ep = BULK_IN;
+			in_left--;
+		} else {
+			ep = BULK_OUT;
+			out_left--;
+		}
+
+		if (p->verify && ep == BULK_OUT) {
+			u3verify_fill(&state->verify_tx, buf, xfer_size);
+		} else if (p->prbs != PRBS_NONE && ep == BULK_OUT) {
+			prbs_fill(&state->prbs_tx, buf, xfer_size);
+		} else {
+			memset(buf, 0xC5, xfer_size);
+		}
+
+		if (p->ep_type == U3LOOP_EP_TYPE_ISO) {
+			libusb_fill_iso_transfer(xfers[i], dev, ep, buf,
+					xfer_size, iso_packets, transfer_cb,
+					&ctxs[i], USB_TIMEOUT);
+			libusb_set_iso_packet_lengths(xfers[i], p->ep_bytes);
+		} else if (p->ep_type == U3LOOP_EP_TYPE_INT) {
+			libusb_fill_interrupt_transfer(xfers[i], dev, ep, buf,
+					xfer_size, transfer_cb, &ctxs[i],
+					USB_TIMEOUT);
+		} else {
+			libusb_fill_bulk_transfer(xfers[i], dev, ep, buf,
+					xfer_size, transfer_cb, &ctxs[i],
+					USB_TIMEOUT);
+
+			struct pacer *pacer = (ep == BULK_OUT) ?
+				&run->tx_pacer : &run->rx_pacer;
+			if (pacer->rate > 0) {
+				ctxs[i].pacer = pacer;
+				if (!pacer_take(pacer, xfer_size, &state->start_time)) {
+					pacer_park(pacer, xfers[i]);
+					continue;
+				}
+			}
+		}
+
+		err = submit_transfer(xfers[i]);
+		if (err != LIBUSB_SUCCESS) {
+			fprintf(stderr, "Failed to submit transfer: %s\n", libusb_strerror(err));
+			goto fail;
+		}
+	}
+
+	if (run->use_dev_mem == 1) {
+		state->buffers = BUF_DEV_MEM;
+	} else if (run->pool.base != NULL) {
+		state->buffers = BUF_HUGE;
+	} else {
+		state->buffers = BUF_MALLOC;
+	}
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &state->cpu_start);
+
+	return 0;
+
+fail:
+	stop_run(run);
+	return -1;
+}
+
+/**
+ * Pin calling thread to a CPU
+ *
+ * @param saved	If not NULL, returns the previous affinity for
+ *		restore_affinity()
+ *
+ * @returns 0 on success, -1 on error
+ */
+int pin_thread(int cpu, cpu_set_t *saved)
+{
+	cpu_set_t cpus;
+	int err;
+
+	if (saved != NULL) {
+		err = pthread_getaffinity_np(pthread_self(), sizeof(*saved),
+				saved);
+		if (err != 0) {
+			fprintf(stderr, "Failed to get thread affinity: %s\n",
+					strerror(err));
+			return -1;
+		}
+	}
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (err != 0) {
+		fprintf(stderr, "Failed to pin thread to CPU %d: %s\n", cpu,
+				strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Undo pin_thread() of calling thread
+ */
+void restore_affinity(const cpu_set_t *saved)
+{
+	int err;
+
+	err = pthread_setaffinity_np(pthread_self(), sizeof(*saved), saved);
+	if (err != 0) {
+		fprintf(stderr, "Failed to restore thread affinity: %s\n",
+				strerror(err));
+	}
+}
+
+/**
+ * Hand interval statistics to the reporter, if it asked for them
+ */
+void publish_stats(struct state_t *state, struct stat_slot *slot,
+		const struct timespec *now)
+{
+	unsigned int req = atomic_load_explicit(&slot->req, memory_order_relaxed);
+	if (req == atomic_load_explicit(&slot->ack, memory_order_relaxed)) {
+		return;
+	}
+
+	slot->time = *now;
+	slot->ops = state->ops;
+	slot->ctrs = state->ctrs;
+	slot->host_errors = state->host_errors;
+	slot->dev_errors = state->dev_errors;
+	slot->volt = state->volt;
+	slot->tx_latency = state->tx_latency;
+	slot->rx_latency = state->rx_latency;
+	slot->ctrl_latency = state->ctrl_latency;
+
+	// Clear non cumulative statistics
+	memset(&state->dev_errors, 0, sizeof(state->dev_errors));
+	memset(&state->volt, 0, sizeof(state->volt));
+	memset(&state->host_errors, 0, sizeof(state->host_errors));
+	hist_reset(&state->tx_latency);
+	hist_reset(&state->rx_latency);
+	hist_reset(&state->ctrl_latency);
+
+	atomic_store_explicit(&slot->ack, req, memory_order_release);
+}
+
+/**
+ * Handle USB events until the reporter stops the test
+ *
+ * All transfer callbacks run in this thread, so it owns the statistics in
+ * the states of the runs. They are handed to the reporter through the stat
+ * slots; nothing here waits on the reporter or on output.
+ */
+void *event_thread(void *arg)
+{
+	struct event_loop *ev = (struct event_loop *) arg;
+	struct timeval tick = { 0, EVENT_TICK_MS * 1000 };
+	bool warming_up = !atomic_load(&ev->warmed_up);
+	struct timespec now;
+	unsigned int i;
+
+	if (ev->params->event_cpu >= 0) {
+		pin_thread(ev->params->event_cpu, NULL);
+	}
+	if (ev->params->tx_rate > 0 || ev->params->rx_rate > 0) {
+		// Parked transfers are only submitted when we wake up
+		tick.tv_usec = PACE_TICK_US;
+	}
+
+	while (!atomic_load_explicit(&ev->stop, memory_order_relaxed)) {
+		libusb_handle_events_timeout_completed(NULL, &tick, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (i=0; i < ev->run_cnt && !terminate; i++) {
+			struct test_run *run = &ev->runs[i];
+
+			if (pacer_service(&run->tx_pacer, &run->state->tx_pace, &now) != 0 ||
+			    pacer_service(&run->rx_pacer, &run->state->rx_pace, &now) != 0 ||
+			    run->state->active_transfers + run->tx_pacer.parked_cnt +
+					run->rx_pacer.parked_cnt != run->xfer_cnt)
+			{
+				atomic_store(&ev->failed, true);
+				return NULL;
+			}
+			sampler_service(&run->errs, &now);
+			sampler_service(&run->volt, &now);
+		}
+
+		if (warming_up) {
+			if (elapsed_usec(&ev->start_time, &now) <
+					ev->params->warmup_ms * 1000ull) {
+				continue;
+			}
+
+			// Restart statistics now the queue is in a steady state
+			for (i=0; i < ev->run_cnt; i++) {
+				restart_statistics(ev->runs[i].state, &now);
+				pacer_restart(&ev->runs[i].tx_pacer, &now);
+				pacer_restart(&ev->runs[i].rx_pacer, &now);
+			}
+			ev->start_time = now;
+			warming_up = false;
+			atomic_store_explicit(&ev->warmed_up, true,
+					memory_order_release);
+		}
+
+		for (i=0; i < ev->run_cnt; i++) {
+			publish_stats(ev->runs[i].state, &ev->slots[i], &now);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Run the same test on one or more opened devices at a time
+ *
+ * Submits the transfers described by p on every device, handles USB events
+ * until the time limit expires or the program is terminated, and then cancels
+ * and frees all transfers. Statistics of every device are collected in the
+ * state of its run. All states share the same start time, which is reset
+ * again when the warm-up period ends, so measurements line up.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int run_tests(struct test_run *runs, unsigned int run_cnt,
+		const struct test_params *p)
+{
+	int retval = -1;
+	int err;
+	unsigned int i;
+	unsigned int started;
+
+	for (started=0; started < run_cnt; started++) {
+		if (start_run(&runs[started], p) != 0) {
+			goto fail;
+		}
+	}
+
+	// Align statistics of all devices
+	struct timespec start_time;
+	if (clock_gettime(CLOCK_MONOTONIC, &start_time) == -1) {
+		perror("clock_gettime");
+		goto fail;
+	}
+	for (i=0; i < run_cnt; i++) {
+		runs[i].state->start_time = start_time;
+		runs[i].state->measurement_time = start_time;
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &runs[i].state->cpu_start);
+	}
+
+	if (p->report_ival > 0) {
+		print_measurement_header(p, run_cnt > 1);
+	}
+
+	// Hand USB event handling to its own thread, so slow output can't
+	// delay completions
+	struct event_loop ev = {
+		.runs = runs,
+		.run_cnt = run_cnt,
+		.params = p,
+		.start_time = start_time,
+	};
+	atomic_init(&ev.stop, false);
+	atomic_init(&ev.failed, false);
+	atomic_init(&ev.warmed_up, (p->warmup_ms == 0));
+	ev.slots = aligned_alloc(CACHE_LINE_SIZE, run_cnt * sizeof(*ev.slots));
+	if (ev.slots == NULL) {
+		perror("aligned_alloc()");
+		goto fail;
+	}
+	memset(ev.slots, 0, run_cnt * sizeof(*ev.slots));
+	for (i=0; i < run_cnt; i++) {
+		atomic_init(&ev.slots[i].req, 0);
+		atomic_init(&ev.slots[i].ack, 0);
+	}
+
+	pthread_t thread;
+	err = pthread_create(&thread, NULL, event_thread, &ev);
+	if (err != 0) {
+		fprintf(stderr, "Failed to create event thread: %s\n", strerror(err));
+		free(ev.slots);
+		goto fail;
+	}
+
+	// Main loop
+	bool done = false;
+	bool take_measurement = false;
+	struct timespec tick = { 0, REPORT_TICK_MS * 1000000 };
+	time_t last_time_running = 0;
+	while (!terminate && !done) {
+		nanosleep(&tick, NULL);
+
+		if (atomic_load(&ev.failed)) {
+			// Detect if there was an error resubmitting transfers
+			fprintf(stderr, "Some transfers could not be resubmitted, aborting\n");
+			goto fail_thread;
+		}
+		if (!atomic_load_explicit(&ev.warmed_up, memory_order_acquire)) {
+			continue;
+		}
+
+		// Service periodic things
+		// TODO: use timer to set _take_measurement_. To prevent
+		// calling clock_gettime() a lot on platforms that still use a
+		// slow library/kernel call for this.
+		struct timespec now;
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+			perror("clock_gettime");
+			goto fail_thread;
+		}
+
+		time_t time_running =  now.tv_sec - ev.start_time.tv_sec;
+		if (now.tv_nsec < ev.start_time.tv_nsec) {
+			time_running -= 1;
+		}
+
+		if (time_running != last_time_running) {
+			last_time_running = time_running;
+			if (p->time_limit > 0 && time_running >= p->time_limit) {
+				done = true;
+			}
+
+			if (p->report_ival > 0 && time_running % p->report_ival == 0) {
+				take_measurement = true;
+			}
+		}
+
+		// Take Measurement
+		if (take_measurement || ((terminate || done) && p->report_ival != 0)) {
+			take_measurement = false;
+
+			// Request snapshots of all devices at once, so the
+			// intervals line up
+			for (i=0; i < run_cnt; i++) {
+				atomic_fetch_add_explicit(&ev.slots[i].req, 1,
+						memory_order_relaxed);
+			}
+
+			// Print measurement
+			for (i=0; i < run_cnt; i++) {
+				struct stat_slot *slot = &ev.slots[i];
+				unsigned int req = atomic_load_explicit(&slot->req,
+						memory_order_relaxed);
+				while (atomic_load_explicit(&slot->ack,
+						memory_order_acquire) != req)
+				{
+					if (atomic_load(&ev.failed)) {
+						fprintf(stderr, "Some transfers could not be resubmitted, aborting\n");
+						goto fail_thread;
+					}
+					nanosleep(&tick, NULL);
+				}
+				print_measurement(runs[i].state, slot);
+			}
+		}
+	}
+
+	retval = 0;
+
+fail_thread:
+	atomic_store(&ev.stop, true);
+	pthread_join(thread, NULL);
+	free(ev.slots);
+fail:
+	for (i=0; i < started; i++) {
+		stop_run(&runs[i]);
+	}
+
+	return retval;
+}
+
+/**
+ * Submit usbfs URB and account it as active
+ *
+ * @returns 0 on success, -errno on error
+ */
+int submit_urb(struct usbfs_dev *ufs, struct state_t *state,
+		struct urb_ctx *ctx)
+{
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &ctx->submit_time);
+
+	err = usbfs_submit(ufs, &ctx->urb);
+	if (err == 0) {
+		state->active_transfers++;
+	}
+
+	return err;
+}
+
+/**
+ * Account a reaped usbfs URB, like transfer_cb() does for libusb transfers
+ *
+ * @returns true if the URB should be resubmitted
+ */
+bool urb_complete(struct state_t *state, struct urb_ctx *ctx,
+		const struct timespec *now)
+{
+	struct usbdevfs_urb *urb = &ctx->urb;
+	bool is_tx = ((urb->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT);
+
+	state->active_transfers--;
+
+	switch (urb->status) {
+	case 0:
+		state->ops++;
+
+		uint64_t latency = (now->tv_sec - ctx->submit_time.tv_sec) * 1000000000ull +
+				now->tv_nsec - ctx->submit_time.tv_nsec;
+		if (is_tx) {
+			hist_record(&state->tx_latency, latency);
+			hist_record(&state->cum_tx_latency, latency);
+		} else {
+			hist_record(&state->rx_latency, latency);
+			hist_record(&state->cum_rx_latency, latency);
+		}
+
+		data_complete(state, is_tx, urb->buffer, urb->buffer_length,
+				urb->actual_length);
 		break;
-	case LIBUSB_TRANSFER_STALL:
+	case -EPIPE:
 		state->host_errors.stall++;
 		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
+	case -EOVERFLOW:
 		state->host_errors.overflow++;
 		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
+	case -ETIMEDOUT:
+		state->host_errors.timeout++;
+		break;
+	case -ENODEV:
+	case -ESHUTDOWN:
 		fprintf(stderr, "Device disconnected\n");
 		terminate = true;
+		return false;
+	case -ENOENT:
+	case -ECONNRESET:
+		return false; // Stop on cancellation of URB
+	default:
+		state->host_errors.error++;
 		break;
-	case LIBUSB_TRANSFER_CANCELLED:
-		return; // Stop on cancellation of transfer
+	}
+
+	if (terminate || state->stopping) {
+		return false;
+	}
+
+	if (is_tx && state->params->verify) {
+		u3verify_fill(&state->verify_tx, urb->buffer, urb->buffer_length);
+	} else if (is_tx && state->params->prbs != PRBS_NONE) {
+		prbs_fill(&state->prbs_tx, urb->buffer, urb->buffer_length);
+	}
+
+	return true;
+}
+
+/**
+ * Run a single bulk test with raw usbfs URBs instead of libusb
+ *
+ * Runs the same workload as run_test(), but submits and reaps URBs with
+ * usbfs ioctls from the calling thread, waiting for completions with epoll.
+ * Buffers are mapped from usbfs when possible, so no data is copied. This
+ * takes the per-transfer overhead of libusb out of the measurement.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int run_usbfs_test(struct libusb_device_handle *dev,
+		const struct test_params *p, struct state_t *state)
+{
+	struct usbfs_dev ufs;
+	struct urb_ctx *ctxs;
+	cpu_set_t saved_cpus;
+	bool pinned = false;
+	unsigned int xfer_cnt;
+	unsigned int in_left = 0;
+	unsigned int out_left = 0;
+	int zero_copy = 1;
+	int retval = -1;
+	int err;
+	unsigned int i;
+
+	if (p->mode != U3LOOP_MODE_WRITE) {
+		in_left = p->depth_in;
+	}
+	if (p->mode != U3LOOP_MODE_READ) {
+		out_left = p->depth_out;
+	}
+	xfer_cnt = in_left + out_left;
+	if (xfer_cnt == 0) {
+		fprintf(stderr, "Queue depth must be at least 1\n");
+		return -1;
+	}
+
+	// Interface claims are per file descriptor, so hand the interface
+	// over from libusb to usbfs for the duration of the test.
+	libusb_device *udev = libusb_get_device(dev);
+	libusb_release_interface(dev, IFNUM);
+	err = usbfs_open(&ufs, libusb_get_bus_number(udev),
+			libusb_get_device_address(udev), IFNUM);
+	if (err != 0) {
+		fprintf(stderr, "Failed to open usbfs device: %s\n", strerror(-err));
+		goto fail0;
+	}
+
+	ctxs = calloc(xfer_cnt, sizeof(*ctxs));
+	if (ctxs == NULL) {
+		perror("calloc()");
+		goto fail1;
+	}
+
+	// Runs in the calling thread, which is the reporter otherwise
+	if (p->event_cpu >= 0) {
+		pinned = (pin_thread(p->event_cpu, &saved_cpus) == 0);
+	}
+
+	const char *name = state->name;
+	memset(state, 0, sizeof(*state));
+	state->params = p;
+	state->name = name;
+	if (p->verify) {
+		uint32_t run_id = u3verify_run_id();
+		u3verify_tx_init(&state->verify_tx, run_id);
+		u3verify_rx_init(&state->verify_rx, run_id);
+	}
+	prbs_init(&state->prbs_tx, p->prbs);
+
+	if (clock_gettime(CLOCK_MONOTONIC, &(state->start_time)) == -1) {
+		perror("clock_gettime");
+		goto fail2;
+	}
+	state->measurement_time = state->start_time;
+
+	// Allocate and submit URBs
+	for (i=0; i < xfer_cnt; i++) {
+		uint8_t *buf = usbfs_alloc(&ufs, p->transfer_size,
+				&ctxs[i].zero_copy);
+		if (buf == NULL) {
+			perror("malloc()");
+			goto fail2;
+		}
+		zero_copy &= ctxs[i].zero_copy;
+
+		// Determine endpoint, alternate while both directions have
+		// transfers left.
+		int ep;
+		if (in_left > 0 && (out_left == 0 || (i & 1) == 0)) {
+			ep = BULK_IN;
+			in_left--;
+		} else {
+			ep = BULK_OUT;
+			out_left--;
+		}
+
+		if (p->verify && ep == BULK_OUT) {
+			u3verify_fill(&state->verify_tx, buf, p->transfer_size);
+		} else if (p->prbs != PRBS_NONE && ep == BULK_OUT) {
+			prbs_fill(&state->prbs_tx, buf, p->transfer_size);
+		} else {
+			memset(buf, 0xC5, p->transfer_size);
+		}
+
+		usbfs_fill_bulk(&ctxs[i].urb, ep, buf, p->transfer_size);
+		ctxs[i].urb.usercontext = &ctxs[i];
+
+		err = submit_urb(&ufs, state, &ctxs[i]);
+		if (err != 0) {
+			fprintf(stderr, "Failed to submit URB: %s\n", strerror(-err));
+			goto fail2;
+		}
+	}
+	state->buffers = zero_copy ? BUF_DEV_MEM : BUF_MALLOC;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &state->cpu_start);
+	if (verbose) {
+		printf("usbfs buffers %s\n", zero_copy ?
+				"mapped from kernel, zero-copy" :
+				"not mappable, using malloc()");
+	}
+
+	if (p->report_ival > 0) {
+		print_measurement_header(p, false);
+	}
+
+	// Main loop; reaps, resubmits and reports from a single thread
+	struct stat_slot slot;
+	memset(&slot, 0, sizeof(slot));
+	atomic_init(&slot.req, 0);
+	atomic_init(&slot.ack, 0);
+	bool done = false;
+	bool warming_up = (p->warmup_ms > 0);
+	bool take_measurement = false;
+	time_t last_time_running = 0;
+	while (!terminate && !done) {
+		err = usbfs_wait(&ufs, EVENT_TICK_MS);
+		if (err < 0) {
+			if (err == -ENODEV) {
+				fprintf(stderr, "Device disconnected\n");
+			} else {
+				fprintf(stderr, "Failed to wait for URBs: %s\n", strerror(-err));
+			}
+			goto fail2;
+		}
+
+		struct timespec now;
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+			perror("clock_gettime");
+			goto fail2;
+		}
+
+		struct usbdevfs_urb *urb;
+		while ((urb = usbfs_reap(&ufs)) != NULL) {
+			struct urb_ctx *ctx = (struct urb_ctx *) urb->usercontext;
+			if (urb_complete(state, ctx, &now)) {
+				err = submit_urb(&ufs, state, ctx);
+				if (err != 0) {
+					fprintf(stderr, "Failed to submit URB: %s\n", strerror(-err));
+				}
+			}
+		}
+
+		if (!terminate && state->active_transfers != xfer_cnt) {
+			// Detect if there was an error resubmitting URBs
+			fprintf(stderr, "Some transfers could not be resubmitted, aborting\n");
+			goto fail2;
+		}
+
+		if (warming_up) {
+			if (elapsed_usec(&state->start_time, &now) <
+					p->warmup_ms * 1000ull) {
+				continue;
+			}
+
+			// Restart statistics now the queue is in a steady state
+			restart_statistics(state, &now);
+			warming_up = false;
+			continue;
+		}
+
+		time_t time_running =  now.tv_sec - state->start_time.tv_sec;
+		if (now.tv_nsec < state->start_time.tv_nsec) {
+			time_running -= 1;
+		}
+
+		if (time_running != last_time_running) {
+			last_time_running = time_running;
+			if (p->time_limit > 0 && time_running >= p->time_limit) {
+				done = true;
+			}
+
+			if (p->report_ival > 0 && time_running % p->report_ival == 0) {
+				take_measurement = true;
+			}
+		}
+
+		if (take_measurement || ((terminate || done) && p->report_ival != 0)) {
+			take_measurement = false;
+
+			atomic_fetch_add(&slot.req, 1);
+			publish_stats(state, &slot, &now);
+			print_measurement(state, &slot);
+		}
+	}
+
+	retval = 0;
+
+fail2:
+	if (clock_gettime(CLOCK_MONOTONIC, &(state->stop_time)) == -1) {
+		perror("clock_gettime");
+	}
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &state->cpu_stop);
+
+	// Cancel all submitted URBs and wait for them to be returned
+	state->stopping = true;
+	for (i=0; i < xfer_cnt; i++) {
+		if (ctxs[i].urb.buffer != NULL) {
+			usbfs_discard(&ufs, &ctxs[i].urb);
+		}
+	}
+	while (state->active_transfers != 0 &&
+	       usbfs_wait(&ufs, USB_TIMEOUT) > 0)
+	{
+		struct usbdevfs_urb *urb;
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while ((urb = usbfs_reap(&ufs)) != NULL) {
+			urb_complete(state, (struct urb_ctx *) urb->usercontext, &now);
+		}
+	}
+	fold_errors(state);
+	if (p->verify) {
+		u3verify_rx_finish(&state->verify_rx);
+	}
+
+	for (i=0; i < xfer_cnt; i++) {
+		if (ctxs[i].urb.buffer != NULL) {
+			usbfs_free(&ufs, ctxs[i].urb.buffer, p->transfer_size,
+					ctxs[i].zero_copy);
+		}
+	}
+	free(ctxs);
+fail1:
+	usbfs_close(&ufs);
+fail0:
+	err = libusb_claim_interface(dev, IFNUM);
+	if (err != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Failed to claim device interface: %s\n",
+				libusb_error_name(err));
+		retval = -1;
+	}
+	if (pinned) {
+		restore_affinity(&saved_cpus);
+	}
+
+	return retval;
+}
+
+/**
+ * Run a single test on an opened device
+ *
+ * @returns 0 on success, -1 on error
+ */
+int run_test(struct libusb_device_handle *dev, const struct test_params *p,
+		struct state_t *state)
+{
+	struct test_run run = {
+		.dev = dev,
+		.state = state,
+	};
+
+	if (p->usbfs) {
+		return run_usbfs_test(dev, p, state);
+	}
+
+	return run_tests(&run, 1, p);
+}
+
+/**
+ * Wait until all transfers of a burst have completed
+ */
+void wait_burst(struct test_run *run)
+{
+	struct timeval tick = { 0, EVENT_TICK_MS * 1000 };
+	struct timespec now;
+
+	while (run->state->active_transfers != 0) {
+		libusb_handle_events_timeout_completed(NULL, &tick, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sampler_service(&run->errs, &now);
+		sampler_service(&run->volt, &now);
+	}
+}
+
+/**
+ * Run bulk transfers in bursts separated by idle gaps
+ *
+ * Every burst submits all transfers once, and waits for them to complete.
+ * During the gap before a burst the link is idle, so with Link Power
+ * Management enabled it can drop into U1 or U2. The latency of the first
+ * transfer per direction of a burst then includes the exit latency, and is
+ * recorded per gap length. The first burst has no gap and isn't recorded.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int run_burst_test(struct libusb_device_handle *dev,
+		const struct test_params *p, struct state_t *state, bool csv)
+{
+	struct test_run run = {
+		.dev = dev,
+		.state = state,
+	};
+	struct histogram *wake;
+	cpu_set_t saved_cpus;
+	bool pinned = false;
+	int first_tx = -1;
+	int first_rx = -1;
+	struct timespec now;
+	unsigned int cycle;
+	int retval = -1;
+	int err;
+	unsigned int i;
+
+	// First transfer latency per gap, write and read
+	wake = calloc(p->gap_cnt * 2, sizeof(*wake));
+	if (wake == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	// Runs in the calling thread, which is the reporter otherwise
+	if (p->event_cpu >= 0) {
+		pinned = (pin_thread(p->event_cpu, &saved_cpus) == 0);
+	}
+
+	if (start_run(&run, p) != 0) {
+		goto fail0;
+	}
+	for (i=0; i < run.xfer_cnt; i++) {
+		bool is_tx = ((run.xfers[i]->endpoint & LIBUSB_ENDPOINT_DIR_MASK) ==
+				LIBUSB_ENDPOINT_OUT);
+		if (is_tx && first_tx < 0) {
+			first_tx = i;
+		} else if (!is_tx && first_rx < 0) {
+			first_rx = i;
+		}
+	}
+	wait_burst(&run);
+
+	for (cycle=0; !terminate; cycle++) {
+		unsigned int gap = cycle % p->gap_cnt;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (p->time_limit != 0 &&
+		    now.tv_sec - state->start_time.tv_sec >= p->time_limit)
+		{
+			break;
+		}
+
+		struct timespec idle = {
+			.tv_sec = p->gaps_usec[gap] / 1000000,
+			.tv_nsec = (p->gaps_usec[gap] % 1000000) * 1000
+		};
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &idle, NULL);
+
+		for (i=0; i < run.xfer_cnt; i++) {
+			err = submit_transfer(run.xfers[i]);
+			if (err != LIBUSB_SUCCESS) {
+				fprintf(stderr, "Failed to submit transfer: %s\n", libusb_strerror(err));
+				goto fail1;
+			}
+		}
+		wait_burst(&run);
+
+		if (first_tx >= 0 &&
+		    run.xfers[first_tx]->status == LIBUSB_TRANSFER_COMPLETED)
+		{
+			hist_record(&wake[gap * 2], run.ctxs[first_tx].latency);
+		}
+		if (first_rx >= 0 &&
+		    run.xfers[first_rx]->status == LIBUSB_TRANSFER_COMPLETED)
+		{
+			hist_record(&wake[gap * 2 + 1], run.ctxs[first_rx].latency);
+		}
+	}
+
+	retval = 0;
+
+fail1:
+	stop_run(&run);
+	if (retval != 0) {
+		goto fail0;
+	}
+
+	print_report(state, csv);
+	if (!csv) {
+		printf("\n");
+		printf("First transfer latency after idle gap (usec):\n");
+	}
+	for (i=0; i < p->gap_cnt; i++) {
+		if (csv) {
+			printf("%u", p->gaps_usec[i]);
+			print_latency_csv(&wake[i * 2]);
+			print_latency_csv(&wake[i * 2 + 1]);
+			printf("\n");
+			continue;
+		}
+
+		char name[32];
+		if (wake[i * 2].count != 0) {
+			snprintf(name, sizeof(name), "%8u write", p->gaps_usec[i]);
+			print_latency(name, &wake[i * 2]);
+		}
+		if (wake[i * 2 + 1].count != 0) {
+			snprintf(name, sizeof(name), "%8u read ", p->gaps_usec[i]);
+			print_latency(name, &wake[i * 2 + 1]);
+		}
+	}
+
+fail0:
+	if (pinned) {
+		restore_affinity(&saved_cpus);
+	}
+	free(wake);
+	return retval;
+}
+
+/**
+ * Report total throughput of devices tested at a time
+ *
+ * Fairness is Jain's index over the throughput of the devices: 1 if all
+ * devices got the same throughput, 1/n if a single device got everything.
+ */
+void print_aggregate(const struct state_t *states, unsigned int cnt, bool csv)
+{
+	double tx_mbps = 0;
+	double rx_mbps = 0;
+	double sum = 0;
+	double sum_sq = 0;
+	double min_mbps = INFINITY;
+	double max_mbps = 0;
+	unsigned int i;
+
+	for (i=0; i < cnt; i++) {
+		const struct state_t *s = &states[i];
+		uint64_t usec = elapsed_usec(&s->start_time, &s->stop_time);
+		if (usec == 0) continue;
+
+		double dev_tx = (double) s->ctrs.tx_bytes * 8 / usec;
+		double dev_rx = (double) s->ctrs.rx_bytes * 8 / usec;
+		double dev_mbps = dev_tx + dev_rx;
+
+		tx_mbps += dev_tx;
+		rx_mbps += dev_rx;
+		sum += dev_mbps;
+		sum_sq += dev_mbps * dev_mbps;
+		if (dev_mbps < min_mbps) min_mbps = dev_mbps;
+		if (dev_mbps > max_mbps) max_mbps = dev_mbps;
+	}
+	double fairness = (sum_sq != 0) ? sum * sum / (cnt * sum_sq) : 0;
+	if (min_mbps == INFINITY) min_mbps = 0;
+
+	if (csv) {
+		printf("total, %u, %.2f, %.2f, %.2f, %.4f\n",
+			cnt, tx_mbps + rx_mbps, tx_mbps, rx_mbps, fairness);
+	} else {
+		printf("\nAggregate Report:\n");
+		printf("-----------------\n");
+		printf("Devices: %u\n", cnt);
+		printf("\n");
+		printf("Total speed:       %7.2f Mbit/s\n", tx_mbps + rx_mbps);
+		printf("Total write speed: %7.2f Mbit/s\n", tx_mbps);
+		printf("Total read speed:  %7.2f Mbit/s\n", rx_mbps);
+		printf("\n");
+		printf("Per device speed: min: %.2f, mean: %.2f, max: %.2f Mbit/s\n",
+			min_mbps, sum / cnt, max_mbps);
+		printf("Fairness (Jain's index): %.4f\n", fairness);
+	}
+}
+
+/**
+ * Run a test for every point in a sweep
+ *
+ * Every point is run with the parameters in base, except for the queue depth
+ * and transfer size, which are taken from the point. The measured throughput
+ * is stored in the point.
+ *
+ * @returns 0 on success, -1 on error or if terminated
+ */
+int run_sweep(struct libusb_device_handle *dev, const struct test_params *base,
+		struct sweep_point *points, size_t cnt)
+{
+	struct test_params p = *base;
+	struct state_t state = { 0 };
+	size_t i;
+
+	for (i=0; i < cnt && !terminate; i++) {
+		p.depth_in = points[i].depth_in;
+		p.depth_out = points[i].depth_out;
+		p.transfer_size = points[i].transfer_size;
+
+		if (verbose) {
+			printf("Sweep step %zu/%zu: depth in/out: %u/%u, "
+				"transfer size: %zu\n", i + 1, cnt,
+				p.depth_in, p.depth_out, p.transfer_size);
+		}
+
+		if (run_test(dev, &p, &state) != 0) {
+			return -1;
+		}
+
+		uint64_t usec = elapsed_usec(&state.start_time, &state.stop_time);
+		if (usec == 0) usec = 1;
+		points[i].tx_mbps = (double) state.ctrs.tx_bytes * 8 / usec;
+		points[i].rx_mbps = (double) state.ctrs.rx_bytes * 8 / usec;
+		points[i].tx_xfers_sec = (double) state.ctrs.tx_xfers * 1000000 / usec;
+		points[i].rx_xfers_sec = (double) state.ctrs.rx_xfers * 1000000 / usec;
+	}
+
+	return terminate ? -1 : 0;
+}
+
+/**
+ * Print results of a queue depth sweep
+ *
+ * The knee is the smallest depth at which the throughput in the swept
+ * direction reaches SWEEP_KNEE_PCT percent of the maximum.
+ */
+void print_depth_sweep(const char *title, struct sweep_point *points,
+		size_t cnt, bool out_swept, bool csv)
+{
+	double max_mbps = 0;
+	size_t knee = 0;
+	size_t i;
+
+	for (i=0; i < cnt; i++) {
+		double mbps = out_swept ? points[i].tx_mbps : points[i].rx_mbps;
+		if (mbps > max_mbps) max_mbps = mbps;
+	}
+	for (i=0; i < cnt; i++) {
+		double mbps = out_swept ? points[i].tx_mbps : points[i].rx_mbps;
+		if (mbps * 100 >= max_mbps * SWEEP_KNEE_PCT) {
+			knee = i;
+			break;
+		}
+	}
+
+	if (csv) {
+		for (i=0; i < cnt; i++) {
+			printf("%s, %u, %u, %.2f, %.2f, %d\n", title,
+				points[i].depth_in, points[i].depth_out,
+				points[i].tx_mbps, points[i].rx_mbps,
+				i == knee);
+		}
+		return;
+	}
+
+	printf("\nQueue depth sweep: %s\n", title);
+	printf("--------------------------\n");
+	printf("Depth IN, Depth OUT, TX Speed(mbps), RX Speed(mbps)\n");
+	for (i=0; i < cnt; i++) {
+		printf("%8u, %9u, %14.2f, %14.2f%s\n",
+			points[i].depth_in, points[i].depth_out,
+			points[i].tx_mbps, points[i].rx_mbps,
+			(i == knee) ? "  <-- knee" : "");
+	}
+}
+
+/**
+ * Sweep queue depth from 1 to max_depth for every direction used by mode
+ *
+ * In read/write mode the depth of one direction is swept while the other
+ * direction is kept at the depth given in base.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int run_depth_sweep(struct libusb_device_handle *dev,
+		const struct test_params *base, unsigned int max_depth,
+		bool csv)
+{
+	struct sweep_point *points;
+	int dir;
+	unsigned int i;
+	int retval = 0;
+
+	points = calloc(max_depth, sizeof(*points));
+	if (points == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	if (csv) {
+		printf("Direction, Depth IN, Depth OUT, "
+			"TX Speed(mbps), RX Speed(mbps), Knee\n");
+	}
+
+	for (dir=0; dir < 2 && retval == 0; dir++) {
+		bool out_swept = (dir == 1);
+		if (out_swept && base->mode == U3LOOP_MODE_READ) continue;
+		if (!out_swept && base->mode == U3LOOP_MODE_WRITE) continue;
+
+		for (i=0; i < max_depth; i++) {
+			points[i].depth_in = out_swept ? base->depth_in : i + 1;
+			points[i].depth_out = out_swept ? i + 1 : base->depth_out;
+			points[i].transfer_size = base->transfer_size;
+		}
+
+		retval = run_sweep(dev, base, points, max_depth);
+		if (retval == 0) {
+			print_depth_sweep(out_swept ? "OUT" : "IN", points,
+					max_depth, out_swept, csv);
+		}
+	}
+
+	free(points);
+
+	return retval;
+}
+
+/**
+ * Fit time = overhead + bytes / bandwidth to the results of a size sweep
+ *
+ * The time per transfer is derived from the completion rate of the given
+ * direction. Uses a least squares fit over all points with completions.
+ *
+ * @returns 0 on success, -1 if there are not enough points to fit
+ */
+int fit_transfer_model(const struct sweep_point *points, size_t cnt,
+		bool out_dir, double *overhead_usec, double *mbps)
+{
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	size_t n = 0;
+	size_t i;
+
+	for (i=0; i < cnt; i++) {
+		double xfers_sec = out_dir ? points[i].tx_xfers_sec : points[i].rx_xfers_sec;
+		if (xfers_sec <= 0) continue;
+
+		double x = points[i].transfer_size;
+		double y = 1 / xfers_sec;
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+		n++;
+	}
+
+	double denom = n * sxx - sx * sx;
+	if (n < 2 || denom == 0) {
+		return -1;
+	}
+
+	double slope = (n * sxy - sx * sy) / denom; // Seconds per byte
+	double intercept = (sy - slope * sx) / n;   // Seconds per transfer
+
+	*overhead_usec = intercept * 1000000;
+	*mbps = (slope > 0) ? 8 / slope / 1000000 : INFINITY;
+
+	return 0;
+}
+
+/**
+ * Print results of a transfer size sweep and the fitted overhead model
+ */
+void print_size_sweep(const struct sweep_point *points, size_t cnt, int mode,
+		bool csv)
+{
+	size_t i;
+	int dir;
+
+	if (csv) {
+		printf("Transfer Size, TX Speed(mbps), RX Speed(mbps), "
+			"TX Xfers/s, RX Xfers/s\n");
+		for (i=0; i < cnt; i++) {
+			printf("%zu, %.2f, %.2f, %.1f, %.1f\n",
+				points[i].transfer_size,
+				points[i].tx_mbps, points[i].rx_mbps,
+				points[i].tx_xfers_sec, points[i].rx_xfers_sec);
+		}
+	} else {
+		printf("\nTransfer size sweep:\n");
+		printf("--------------------\n");
+		printf("Transfer Size, TX Speed(mbps), RX Speed(mbps), "
+			"TX Xfers/s, RX Xfers/s\n");
+		for (i=0; i < cnt; i++) {
+			printf("%13zu, %14.2f, %14.2f, %10.1f, %10.1f\n",
+				points[i].transfer_size,
+				points[i].tx_mbps, points[i].rx_mbps,
+				points[i].tx_xfers_sec, points[i].rx_xfers_sec);
+		}
+		printf("\nFitted model: time = overhead + bytes / bandwidth\n");
+	}
+
+	for (dir=0; dir < 2; dir++) {
+		bool out_dir = (dir == 1);
+		if (out_dir && mode == U3LOOP_MODE_READ) continue;
+		if (!out_dir && mode == U3LOOP_MODE_WRITE) continue;
+
+		double overhead_usec;
+		double mbps;
+		if (fit_transfer_model(points, cnt, out_dir, &overhead_usec, &mbps) != 0) {
+			fprintf(stderr, "Not enough data to fit %s model\n",
+					out_dir ? "TX" : "RX");
+			continue;
+		}
+
+		if (csv) {
+			printf("%s, %.3f, %.2f\n", out_dir ? "TX" : "RX",
+					overhead_usec, mbps);
+		} else {
+			printf(" - %s: overhead: %9.3f usec/transfer, "
+				"bandwidth: %8.2f Mbit/s\n",
+				out_dir ? "TX" : "RX", overhead_usec, mbps);
+		}
+	}
+}
+
+/**
+ * Sweep transfer size from min_size to max_size
+ *
+ * Sizes increase by SIZE_SWEEP_FACTOR every step. max_size is always
+ * included as last step.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int run_size_sweep(struct libusb_device_handle *dev,
+		const struct test_params *base, size_t min_size,
+		size_t max_size, bool csv)
+{
+	struct sweep_point *points;
+	size_t cnt = 0;
+	size_t size;
+	int retval;
+
+	for (size = min_size; size < max_size; size *= SIZE_SWEEP_FACTOR) {
+		cnt++;
+	}
+	cnt++;
+
+	points = calloc(cnt, sizeof(*points));
+	if (points == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	size = min_size;
+	for (size_t i=0; i < cnt; i++) {
+		points[i].depth_in = base->depth_in;
+		points[i].depth_out = base->depth_out;
+		points[i].transfer_size = (size < max_size) ? size : max_size;
+		size *= SIZE_SWEEP_FACTOR;
+	}
+
+	retval = run_sweep(dev, base, points, cnt);
+	if (retval == 0) {
+		print_size_sweep(points, cnt, base->mode, csv);
+	}
+
+	free(points);
+
+	return retval;
+}
+
+/**
+ * Run the same test with every type of transfer buffer
+ *
+ * Reports throughput and CPU time per GB of each, to show the cost of the
+ * kernel copying through its own buffers and of page faults and remote
+ * memory.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int run_buffer_ab(struct libusb_device_handle *dev,
+		const struct test_params *base, bool csv)
+{
+	static const struct {
+		enum buf_mode mode;
+		const char *name;
+	} paths[] = {
+		{ BUF_AUTO,   "dev-mem" },
+		{ BUF_MALLOC, "malloc" },
+		{ BUF_HUGE,   "huge" },
+	};
+	struct test_params p = *base;
+	struct state_t state = { 0 };
+	double mbps[ARRAY_SIZE(paths)];
+	double cpu_per_gb[ARRAY_SIZE(paths)];
+	bool measured[ARRAY_SIZE(paths)] = { false };
+	size_t i;
+
+	for (i=0; i < ARRAY_SIZE(paths) && !terminate; i++) {
+		p.buffers = paths[i].mode;
+		if (verbose) {
+			printf("Buffer comparison step %zu/%zu: %s\n", i + 1,
+					ARRAY_SIZE(paths), paths[i].name);
+		}
+
+		if (run_test(dev, &p, &state) != 0) {
+			return -1;
+		}
+
+		// Device memory falls back to malloc() if not supported
+		size_t idx = (paths[i].mode == BUF_AUTO &&
+				state.buffers != BUF_DEV_MEM) ? 1 : i;
+		if (measured[idx]) continue;
+		measured[idx] = true;
+
+		uint64_t usec = elapsed_usec(&state.start_time, &state.stop_time);
+		uint64_t bytes = state.ctrs.tx_bytes + state.ctrs.rx_bytes;
+		double cpu_sec = elapsed_usec(&state.cpu_start, &state.cpu_stop) / 1e6;
+		mbps[idx] = usec ? (double) bytes * 8 / usec : 0;
+		cpu_per_gb[idx] = bytes ? cpu_sec * 1e9 / bytes : 0;
+	}
+	if (terminate) {
+		return -1;
+	}
+
+	if (csv) {
+		for (i=0; i < ARRAY_SIZE(paths); i++) {
+			if (!measured[i]) continue;
+			printf("%s, %.2f, %.4f\n", paths[i].name, mbps[i],
+					cpu_per_gb[i]);
+		}
+	} else {
+		printf("\nBuffer Comparison:\n");
+		printf("------------------\n");
+		printf("Buffers  Speed(mbps)  CPU(Sec./GB)\n");
+		for (i=0; i < ARRAY_SIZE(paths); i++) {
+			if (!measured[i]) {
+				printf("%-8s not supported\n", paths[i].name);
+				continue;
+			}
+			printf("%-8s %11.2f  %12.4f\n", paths[i].name,
+					mbps[i], cpu_per_gb[i]);
+		}
+		if (measured[0] && measured[1] && cpu_per_gb[1] != 0) {
+			// malloc() is the baseline
+			printf("\nDevice memory uses %.1f%% less CPU time per GB\n",
+				(1 - cpu_per_gb[0] / cpu_per_gb[1]) * 100);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Kernel limit on memory pinned by usbfs for all users together
+ *
+ * @returns limit in bytes, 0 if unlimited or unknown
+ */
+size_t usbfs_memory_limit()
+{
+	FILE *fp;
+	unsigned long mb = 0;
+
+	fp = fopen(USBFS_MEMORY_MB_PATH, "r");
+	if (fp == NULL) {
+		return 0;
+	}
+	if (fscanf(fp, "%lu", &mb) != 1) {
+		mb = 0;
+	}
+	fclose(fp);
+
+	return mb * 1024 * 1024;
+}
+
+/**
+ * Estimate usbfs memory pinned by a test
+ *
+ * @param dev_cnt	Number of devices running the test
+ * @param load		Background load device is running
+ */
+size_t usbfs_memory_needed(const struct test_params *p, unsigned int dev_cnt,
+		bool load)
+{
+	size_t xfer_size = p->transfer_size;
+	size_t bulk_cnt = 0;
+
+	if (p->ep_type == U3LOOP_EP_TYPE_ISO) {
+		xfer_size = (size_t) p->iso_packets * p->ep_bytes;
+	} else if (p->ep_type == U3LOOP_EP_TYPE_INT) {
+		xfer_size = p->ep_bytes;
+	}
+	if (p->mode != U3LOOP_MODE_WRITE) {
+		bulk_cnt += p->depth_in;
+	}
+	if (p->mode != U3LOOP_MODE_READ) {
+		bulk_cnt += p->depth_out;
+	}
+
+	size_t ctrl_size = LIBUSB_CONTROL_SETUP_SIZE + p->ctrl_setup.wLength;
+	size_t needed = dev_cnt * (bulk_cnt * (xfer_size + URB_OVERHEAD) +
+			p->ctrl_depth * (ctrl_size + URB_OVERHEAD));
+	if (load) {
+		needed += LOAD_QUEUE_DEPTH * (DEFAULT_TRANSFER_SIZE + URB_OVERHEAD);
+	}
+
+	return needed;
+}
+
+/**
+ * Shrink transfer size and queue depth until a test fits in the usbfs limit
+ *
+ * Only values that weren't given by the user are changed. The transfer size
+ * is halved down to FIT_MIN_TRANSFER_SIZE first, then the queue depth is
+ * reduced, and only then the transfer size is lowered further.
+ *
+ * @returns 0 if the test fits, -1 if not
+ */
+int fit_usbfs_memory(struct test_params *p, unsigned int dev_cnt, bool load,
+		size_t limit, bool size_fixed, bool depth_fixed)
+{
+	// Size of periodic transfers follows from the endpoint
+	if (p->ep_type != U3LOOP_EP_TYPE_BULK) {
+		size_fixed = true;
+	}
+
+	while (usbfs_memory_needed(p, dev_cnt, load) > limit) {
+		if (!size_fixed && p->transfer_size > FIT_MIN_TRANSFER_SIZE) {
+			p->transfer_size = (p->transfer_size / 2) & ~1023ul;
+			if (p->transfer_size < FIT_MIN_TRANSFER_SIZE) {
+				p->transfer_size = FIT_MIN_TRANSFER_SIZE;
+			}
+		} else if (!depth_fixed && (p->depth_in > 1 || p->depth_out > 1)) {
+			if (p->depth_in > 1) p->depth_in--;
+			if (p->depth_out > 1) p->depth_out--;
+		} else if (!size_fixed && p->transfer_size > 1024) {
+			p->transfer_size = (p->transfer_size / 2) & ~1023ul;
+		} else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void print_usbfs_memory_error(size_t needed, size_t limit)
+{
+	fprintf(stderr, "Test needs %.1f MiB of usbfs memory, but the kernel limits "
+			"usbfs to %zu MiB.\n", needed / (1024.0 * 1024), limit / (1024 * 1024));
+	fprintf(stderr, "Lower the transfer size ('-l') or queue depth ('-q'), "
+			"test fewer devices, or\n"
+			"raise the limit, e.g.: echo 0 > " USBFS_MEMORY_MB_PATH "\n");
+}
+
+/**
+ * Parse test mode name: r, w, rw or l
+ *
+ * @returns U3LOOP_MODE_* value, or -1 if unknown
+ */
+int parse_mode(const char *name)
+{
+	if (strcasecmp(name, "r") == 0) {
+		return U3LOOP_MODE_READ;
+	} else if (strcasecmp(name, "w") == 0) {
+		return U3LOOP_MODE_WRITE;
+	} else if (strcasecmp(name, "rw") == 0) {
+		return U3LOOP_MODE_READ_WRITE;
+	} else if (strcasecmp(name, "l") == 0) {
+		return U3LOOP_MODE_LOOPBACK;
+	}
+	return -1;
+}
+
+/**
+ * Parse comma separated list of mode names, or 'all'
+ *
+ * Modifies the string.
+ *
+ * @returns bit mask of U3LOOP_MODE_* values, or 0 on error
+ */
+unsigned int parse_modes(char *list)
+{
+	unsigned int modes = 0;
+	char *tok;
+
+	if (strcmp(list, "all") == 0) {
+		return (1 << U3LOOP_MODE_READ) | (1 << U3LOOP_MODE_WRITE) |
+			(1 << U3LOOP_MODE_READ_WRITE) |
+			(1 << U3LOOP_MODE_LOOPBACK);
+	}
+	for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		int mode = parse_mode(tok);
+		if (mode < 0) {
+			return 0;
+		}
+		modes |= 1 << mode;
+	}
+
+	return modes;
+}
+
+const char *mode_name(int mode)
+{
+	switch (mode) {
+	case U3LOOP_MODE_READ:
+		return "r";
+	case U3LOOP_MODE_WRITE:
+		return "w";
+	case U3LOOP_MODE_READ_WRITE:
+		return "rw";
+	default:
+		return "l";
+	}
+}
+
+unsigned int default_queue_depth(int mode)
+{
+	if (mode == U3LOOP_MODE_READ_WRITE || mode == U3LOOP_MODE_LOOPBACK) {
+		return DEFAULT_QUEUE_DEPTH / 2;
+	}
+	return DEFAULT_QUEUE_DEPTH;
+}
+
+size_t default_transfer_size(int mode)
+{
+	if (mode == U3LOOP_MODE_LOOPBACK) {
+		return LOOPBACK_TRANSFER_SIZE;
+	}
+	return DEFAULT_TRANSFER_SIZE;
+}
+
+/**
+ * Set mode of test parameters, with the default queue depth and transfer
+ * size of that mode, unless given by the user
+ *
+ * @returns 0 on success, -1 if the test doesn't fit in the usbfs limit
+ */
+int set_mode_params(struct test_params *p, int mode, bool depth_fixed,
+		bool size_fixed)
+{
+	size_t limit = usbfs_memory_limit();
+
+	p->mode = mode;
+	if (!depth_fixed) {
+		p->depth_in = default_queue_depth(mode);
+		p->depth_out = p->depth_in;
+	}
+	if (!size_fixed) {
+		p->transfer_size = default_transfer_size(mode);
+	}
+	if (limit != 0 && fit_usbfs_memory(p, 1, false, limit,
+				size_fixed, depth_fixed) != 0)
+	{
+		print_usbfs_memory_error(usbfs_memory_needed(p, 1, false),
+				limit);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Apply a device configuration and measure it
+ *
+ * The time to configure the device, including re-enumeration, is stored
+ * separately in the point; the measurement only starts after the warm-up
+ * period of the test.
+ *
+ * @returns 0 on success, -1 on error or if terminated
+ */
+int measure_config(struct libusb_device_handle **dev, struct config_point *pt,
+		const struct test_params *p, uint16_t vid, uint16_t pid)
+{
+	struct state_t state = { 0 };
+	struct timespec start, stop;
+
+	if (verbose) {
+		printf("Config step: mode: %s, burst: %u, buffers: %u x %u, "
+			"NAK interval: %u\n", mode_name(pt->config.mode),
+			pt->config.ss_burst_len, pt->config.buffer_count,
+			le16toh(pt->config.buffer_size),
+			pt->config.hs_bulk_nak_interval);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	*dev = u3dev_configure(*dev, &pt->config, vid, pid, NULL, NULL);
+	if (*dev == NULL) {
+		return -1;
+	}
+	prepare_device(*dev, false);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	pt->config_sec = elapsed_usec(&start, &stop) / 1000000.0;
+
+	if (run_test(*dev, p, &state) != 0) {
+		return -1;
+	}
+
+	uint64_t usec = elapsed_usec(&state.start_time, &state.stop_time);
+	if (usec == 0) usec = 1;
+	pt->tx_mbps = (double) state.ctrs.tx_bytes * 8 / usec;
+	pt->rx_mbps = (double) state.ctrs.rx_bytes * 8 / usec;
+	pt->tx_p99 = hist_percentile(&state.cum_tx_latency, 99);
+	pt->rx_p99 = hist_percentile(&state.cum_rx_latency, 99);
+
+	return terminate ? -1 : 0;
+}
+
+int config_point_cmp(const void *a, const void *b)
+{
+	const struct config_point *pa = (const struct config_point *) a;
+	const struct config_point *pb = (const struct config_point *) b;
+	double ma = pa->tx_mbps + pa->rx_mbps;
+	double mb = pb->tx_mbps + pb->rx_mbps;
+
+	return (ma < mb) - (ma > mb);
+}
+
+/**
+ * Print ranked results of a configuration sweep of one mode
+ *
+ * Points are sorted by total throughput, best first.
+ */
+void print_config_sweep(struct config_point *points, size_t cnt, bool csv)
+{
+	const char *mode = mode_name(points[0].config.mode);
+	size_t i;
+
+	qsort(points, cnt, sizeof(*points), config_point_cmp);
+
+	if (!csv) {
+		printf("\nConfiguration sweep: %s\n", mode);
+		printf("-----------------------\n");
+		printf("Rank, Burst, Buffers, Buffer Size, NAK Ival, "
+			"TX Speed(mbps), RX Speed(mbps), TX p99(us), RX p99(us), "
+			"Config Time(s)\n");
+	}
+	for (i=0; i < cnt; i++) {
+		const struct config_point *pt = &points[i];
+		if (csv) {
+			printf("%s, %zu, %u, %u, %u, %u, %.2f, %.2f, %.1f, %.1f, %.3f\n",
+				mode, i + 1, pt->config.ss_burst_len,
+				pt->config.buffer_count,
+				le16toh(pt->config.buffer_size),
+				pt->config.hs_bulk_nak_interval,
+				pt->tx_mbps, pt->rx_mbps,
+				pt->tx_p99 / 1000.0, pt->rx_p99 / 1000.0,
+				pt->config_sec);
+		} else {
+			printf("%4zu, %5u, %7u, %11u, %8u, %14.2f, %14.2f, "
+				"%10.1f, %10.1f, %14.3f\n", i + 1,
+				pt->config.ss_burst_len, pt->config.buffer_count,
+				le16toh(pt->config.buffer_size),
+				pt->config.hs_bulk_nak_interval,
+				pt->tx_mbps, pt->rx_mbps,
+				pt->tx_p99 / 1000.0, pt->rx_p99 / 1000.0,
+				pt->config_sec);
+		}
+	}
+	if (!csv) {
+		printf("\nBest configuration for %s: burst: %u, buffers: %u x %u, "
+			"NAK interval: %u, %.2f Mbit/s\n", mode,
+			points[0].config.ss_burst_len,
+			points[0].config.buffer_count,
+			le16toh(points[0].config.buffer_size),
+			points[0].config.hs_bulk_nak_interval,
+			points[0].tx_mbps + points[0].rx_mbps);
+	}
+}
+
+/**
+ * Measure a configuration, unless it was measured before
+ *
+ * @returns index of the point, or -1 on error
+ */
+int add_config_point(struct libusb_device_handle **dev,
+		struct config_point *points, size_t *cnt,
+		const struct u3loop_config *config,
+		const struct test_params *p, uint16_t vid, uint16_t pid)
+{
+	size_t i;
+
+	for (i=0; i < *cnt; i++) {
+		if (memcmp(&points[i].config, config, sizeof(*config)) == 0) {
+			return i;
+		}
+	}
+	if (*cnt == MAX_CONFIG_POINTS) {
+		return -1;
+	}
+
+	memset(&points[*cnt], 0, sizeof(points[*cnt]));
+	points[*cnt].config = *config;
+	if (measure_config(dev, &points[*cnt], p, vid, pid) != 0) {
+		return -1;
+	}
+
+	return (*cnt)++;
+}
+
+/**
+ * Search the device configuration giving the highest throughput per mode
+ *
+ * Instead of the full grid, one parameter is swept at a time, starting from
+ * the default configuration and keeping the best value found before going
+ * to the next parameter: burst length (SuperSpeed only), then buffer count
+ * and size, then the NAK interval (High Speed only). Buffer layouts are
+ * limited to those using between half and all of DEV_BUFFER_MEM.
+ *
+ * The device is configured as in config again afterwards.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int run_config_sweep(struct libusb_device_handle **dev,
+		const struct u3loop_config *config, const struct test_params *base,
+		unsigned int modes, bool depth_fixed, bool size_fixed,
+		uint16_t vid, uint16_t pid, bool csv)
+{
+	static const uint8_t bursts[] = { 1, 2, 4, 8, 16 };
+	static const uint16_t sizes[] = { 0x400, 0x1000, 0x3000, 0x6000, 0xc000 };
+	static const uint8_t naks[] = { 0, 1, 2, 4, 8 };
+	struct config_point *points;
+	size_t cnt;
+	int mode;
+	int best;
+	int idx;
+	size_t i, j;
+	int retval = -1;
+
+	points = calloc(MAX_CONFIG_POINTS, sizeof(*points));
+	if (points == NULL) {
+		perror("calloc()");
+		return -1;
+	}
+
+	if (csv) {
+		printf("Mode, Rank, Burst, Buffers, Buffer Size, NAK Interval, "
+			"TX Speed(mbps), RX Speed(mbps), TX p99(us), RX p99(us), "
+			"Config Time(s)\n");
+	}
+
+	for (mode=0; mode <= U3LOOP_MODE_READ_WRITE; mode++) {
+		if ((modes & (1 << mode)) == 0) continue;
+
+		struct test_params p = *base;
+		if (set_mode_params(&p, mode, depth_fixed, size_fixed) != 0) {
+			goto fail;
+		}
+
+		struct u3loop_config c = *config;
+		init_config(&c, mode, U3LOOP_EP_TYPE_BULK, config->speed);
+		c.polling_interval = config->polling_interval;
+		unsigned int dirs = (mode == U3LOOP_MODE_READ_WRITE) ? 2 : 1;
+
+		cnt = 0;
+		best = add_config_point(dev, points, &cnt, &c, &p, vid, pid);
+		if (best < 0) goto fail;
+
+		for (i=0; c.speed == U3LOOP_SPEED_SUPER &&
+				i < sizeof(bursts) / sizeof(bursts[0]); i++)
+		{
+			c = points[best].config;
+			c.ss_burst_len = bursts[i];
+			idx = add_config_point(dev, points, &cnt, &c, &p, vid, pid);
+			if (idx < 0) goto fail;
+			if (config_point_cmp(&points[idx], &points[best]) < 0) {
+				best = idx;
+			}
+		}
+
+		for (i=0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			for (j=1; j <= 64; j *= 2) {
+				size_t mem = j * sizes[i] * dirs;
+				if (mem * 2 < DEV_BUFFER_MEM || mem > DEV_BUFFER_MEM) {
+					continue;
+				}
+				// Loopback data must fit in the device buffers
+				if (mode == U3LOOP_MODE_LOOPBACK &&
+				    j * sizes[i] < p.transfer_size)
+				{
+					continue;
+				}
+
+				c = points[best].config;
+				c.buffer_count = j;
+				c.buffer_size = htole16(sizes[i]);
+				idx = add_config_point(dev, points, &cnt, &c, &p,
+						vid, pid);
+				if (idx < 0) goto fail;
+				if (config_point_cmp(&points[idx], &points[best]) < 0) {
+					best = idx;
+				}
+			}
+		}
+
+		for (i=0; c.speed == U3LOOP_SPEED_HIGH &&
+				i < sizeof(naks) / sizeof(naks[0]); i++)
+		{
+			c = points[best].config;
+			c.hs_bulk_nak_interval = naks[i];
+			idx = add_config_point(dev, points, &cnt, &c, &p, vid, pid);
+			if (idx < 0) goto fail;
+			if (config_point_cmp(&points[idx], &points[best]) < 0) {
+				best = idx;
+			}
+		}
+
+		print_config_sweep(points, cnt, csv);
+	}
+
+	retval = 0;
+
+fail:
+	free(points);
+
+	// Leave the device as it was, unless it got lost
+	if (*dev != NULL) {
+		*dev = u3dev_configure(*dev, config, vid, pid, NULL, NULL);
+		if (*dev == NULL) {
+			return -1;
+		}
+		prepare_device(*dev, false);
+	}
+
+	return retval;
+}
+
+/**
+ * Theoretical max. bulk throughput in Mbit/s per direction
+ */
+double speed_ceiling(int speed)
+{
+	switch (speed) {
+	case U3LOOP_SPEED_FULL:
+		return 9.728;	// 19 x 64 byte packets per 1 ms frame
+	case U3LOOP_SPEED_HIGH:
+		return 425.984;	// 13 x 512 byte packets per 125 us micro-frame
 	default:
-		assert(false);
+		return 4000;	// 5 Gbit/s, 8b/10b encoded
 	}
+}
 
-	if (!terminate) {
-		err = libusb_submit_transfer(transfer);
-		if (err == LIBUSB_SUCCESS) {
-			state->active_transfers++;
+/**
+ * Measure every mode at every speed up to the speed in config
+ *
+ * The device is re-configured between steps; the time this takes is
+ * reported separately and not part of the measurement. Speeds the port
+ * doesn't support are skipped. Efficiency is relative to the ceiling of
+ * the speed, which only SuperSpeed has in both directions at the same time.
+ * Afterwards the device is configured as in config again.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int run_speed_matrix(struct libusb_device_handle **dev,
+		const struct u3loop_config *config, const struct test_params *base,
+		unsigned int modes, bool depth_fixed, bool size_fixed,
+		uint16_t vid, uint16_t pid, bool csv)
+{
+	struct config_point points[U3LOOP_SPEED_SUPER + 1][U3LOOP_MODE_READ_WRITE + 1];
+	bool skipped[U3LOOP_SPEED_SUPER + 1] = { false };
+	struct u3loop_config c;
+	int speed, mode;
+	int retval = -1;
+
+	memset(points, 0, sizeof(points));
+
+	// Start at the current speed, saving a re-enumeration
+	for (speed=config->speed; speed >= U3LOOP_SPEED_FULL; speed--) {
+		uint64_t reenum_usec = 0;
+		bool first = true;
+
+		for (mode=0; (modes & (1 << mode)) == 0; mode++);
+		c = *config;
+		init_config(&c, mode, U3LOOP_EP_TYPE_BULK, speed);
+		c.polling_interval = config->polling_interval;
+		*dev = u3dev_configure(*dev, &c, vid, pid, NULL, &reenum_usec);
+		if (*dev == NULL) {
+			return -1;
+		}
+		int link = u3dev_link_speed(*dev);
+		if (link != 0 && link < speed) {
+			if (!csv) {
+				printf("Skipping %s, port only supports %s\n",
+					u3dev_speed_name(speed), u3dev_speed_name(link));
+			}
+			skipped[speed] = true;
+			continue;
+		}
+
+		for (mode=0; mode <= U3LOOP_MODE_READ_WRITE; mode++) {
+			struct config_point *pt = &points[speed][mode];
+			struct test_params p = *base;
+
+			if ((modes & (1 << mode)) == 0) continue;
+
+			if (set_mode_params(&p, mode, depth_fixed, size_fixed) != 0) {
+				goto fail;
+			}
+			pt->config = c;
+			init_config(&pt->config, mode, U3LOOP_EP_TYPE_BULK, speed);
+			pt->config.polling_interval = config->polling_interval;
+			if (measure_config(dev, pt, &p, vid, pid) != 0) {
+				goto fail;
+			}
+			if (first) {
+				pt->config_sec += reenum_usec / 1000000.0;
+				first = false;
+			}
+		}
+	}
+
+	if (csv) {
+		printf("Speed, Mode, TX Speed(mbps), RX Speed(mbps), "
+			"Ceiling(mbps), Efficiency(%%), TX p99(us), RX p99(us), "
+			"Config Time(s)\n");
+	} else {
+		printf("\nSpeed matrix\n");
+		printf("------------\n");
+		printf("Speed, Mode, TX Speed(mbps), RX Speed(mbps), "
+			"Ceiling(mbps), Efficiency(%%), TX p99(us), RX p99(us), "
+			"Config Time(s)\n");
+	}
+	for (speed=U3LOOP_SPEED_SUPER; speed >= U3LOOP_SPEED_FULL; speed--) {
+		if (speed > config->speed || skipped[speed]) continue;
+
+		for (mode=0; mode <= U3LOOP_MODE_READ_WRITE; mode++) {
+			const struct config_point *pt = &points[speed][mode];
+			double ceiling = speed_ceiling(speed);
+
+			if ((modes & (1 << mode)) == 0) continue;
+
+			if (speed == U3LOOP_SPEED_SUPER &&
+			    (mode == U3LOOP_MODE_READ_WRITE ||
+			     mode == U3LOOP_MODE_LOOPBACK))
+			{
+				ceiling *= 2;
+			}
+			double eff = (pt->tx_mbps + pt->rx_mbps) * 100 / ceiling;
+			if (csv) {
+				printf("%s, %s, %.2f, %.2f, %.3f, %.1f, %.1f, %.1f, %.3f\n",
+					u3dev_speed_name(speed), mode_name(mode),
+					pt->tx_mbps, pt->rx_mbps, ceiling, eff,
+					pt->tx_p99 / 1000.0, pt->rx_p99 / 1000.0,
+					pt->config_sec);
+			} else {
+				printf("%5s, %4s, %14.2f, %14.2f, %13.3f, %13.1f, "
+					"%10.1f, %10.1f, %14.3f\n",
+					u3dev_speed_name(speed), mode_name(mode),
+					pt->tx_mbps, pt->rx_mbps, ceiling, eff,
+					pt->tx_p99 / 1000.0, pt->rx_p99 / 1000.0,
+					pt->config_sec);
+			}
+		}
+	}
+
+	retval = 0;
+
+fail:
+	// Leave the device as it was, unless it got lost
+	if (*dev != NULL) {
+		*dev = u3dev_configure(*dev, config, vid, pid, NULL, NULL);
+		if (*dev == NULL) {
+			return -1;
+		}
+		prepare_device(*dev, false);
+	}
+
+	return retval;
+}
+
+// Daemon state
+struct daemon_t {
+	struct libusb_device_handle *dev;
+	bool passmark;          // Device must be configured for the test mode
+	struct u3loop_config config; // Current device configuration
+	uint16_t vid;
+	uint16_t pid;
+	struct test_params defaults;
+	bool csv;
+};
+
+/**
+ * Parse a job description
+ *
+ * A job is a single line of space separated KEY=VALUE pairs. Keys that are
+ * not given take the value from the daemon command line:
+ *   mode=r|w|rw|l, size=BYTES, depth=N, ctrl=N, time=SEC, ival=SEC, csv=0|1
+ *
+ * @returns NULL on success, else error message
+ */
+const char *parse_job(const struct daemon_t *d, char *line,
+		struct test_params *p, bool *csv)
+{
+	char *saveptr;
+	char *tok;
+	char *endp;
+	bool size_set = false;
+	bool depth_set = false;
+
+	*p = d->defaults;
+	*csv = d->csv;
+
+	for (tok = strtok_r(line, " \t\r\n", &saveptr); tok != NULL;
+	     tok = strtok_r(NULL, " \t\r\n", &saveptr))
+	{
+		char *val = strchr(tok, '=');
+		if (val == NULL) {
+			return "expected KEY=VALUE";
+		}
+		*val++ = '\0';
+
+		if (strcmp(tok, "mode") == 0) {
+			p->mode = parse_mode(val);
+			if (p->mode < 0) {
+				return "invalid mode";
+			}
+			continue;
+		}
+
+		unsigned long num = strtoul(val, &endp, 10);
+		if (*val == '\0' || *endp != '\0') {
+			return "value must be numeric";
+		}
+		if (strcmp(tok, "size") == 0) {
+			p->transfer_size = num;
+			size_set = true;
+		} else if (strcmp(tok, "depth") == 0) {
+			p->depth_in = p->depth_out = num;
+			depth_set = true;
+		} else if (strcmp(tok, "ctrl") == 0) {
+			p->ctrl_depth = num;
+		} else if (strcmp(tok, "time") == 0) {
+			p->time_limit = num;
+		} else if (strcmp(tok, "ival") == 0) {
+			p->report_ival = num;
+		} else if (strcmp(tok, "csv") == 0) {
+			*csv = (num != 0);
 		} else {
-			fprintf(stderr, "Failed to submit transfer: %s\n", libusb_strerror(err));
+			return "unknown key";
+		}
+	}
+
+	// Defaults depend on the mode
+	if (p->mode != d->defaults.mode) {
+		if (!size_set) {
+			p->transfer_size = default_transfer_size(p->mode);
+		}
+		if (!depth_set) {
+			p->depth_in = p->depth_out = default_queue_depth(p->mode);
+		}
+	}
+	if (*csv) {
+		p->report_ival = 0;
+	}
+
+	if (p->time_limit == 0) {
+		return "time must be at least 1 second";
+	}
+	if (p->transfer_size == 0) {
+		return "size must be at least 1";
+	}
+	if (p->mode == U3LOOP_MODE_LOOPBACK && !d->passmark) {
+		return "loopback mode is only supported by passmark devices";
+	}
+	if (p->verify && p->mode != U3LOOP_MODE_LOOPBACK) {
+		return "verification requires loopback mode";
+	}
+	if (p->prbs != PRBS_NONE && p->mode == U3LOOP_MODE_READ) {
+		return "PRBS requires a mode that writes data";
+	}
+
+	return NULL;
+}
+
+/**
+ * Read a line from a socket
+ *
+ * Gives up after timeout_ms, or when terminated, so a silent client can't
+ * block the daemon.
+ *
+ * @returns 0 on success, -1 on error, timeout or if the line doesn't fit
+ */
+int read_line(int fd, char *buf, size_t size, unsigned int timeout_ms)
+{
+	struct timespec start, now;
+	size_t len = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (len < size - 1) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		uint64_t usec = elapsed_usec(&start, &now);
+		if (terminate || usec >= timeout_ms * 1000ull) {
+			return -1;
+		}
+		int ret = poll(&pfd, 1, timeout_ms - usec / 1000);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		} else if (ret == -1) {
+			return -1;
+		} else if (ret == 0) {
+			continue;
+		}
+
+		ret = read(fd, &buf[len], 1);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret <= 0) {
+			return -1;
+		}
+		if (buf[len] == '\n') {
+			break;
+		}
+		len++;
+	}
+	buf[len] = '\0';
+
+	return (len < size - 1) ? 0 : -1;
+}
+
+/**
+ * Run a single job received on a client connection
+ *
+ * Results are written to the client by temporarily redirecting stdout to it.
+ *
+ * @returns 0 on success, -1 if the device was lost
+ */
+int run_job(struct daemon_t *d, int client)
+{
+	char line[MAX_JOB_LEN];
+	struct test_params p;
+	const char *errmsg;
+	bool csv;
+
+	if (read_line(client, line, sizeof(line), JOB_TIMEOUT_MS) != 0) {
+		dprintf(client, "ERROR: unable to read job\n");
+		return 0;
+	}
+	if (verbose) {
+		printf("Job: %s\n", line);
+	}
+	errmsg = parse_job(d, line, &p, &csv);
+	if (errmsg != NULL) {
+		dprintf(client, "ERROR: %s\n", errmsg);
+		return 0;
+	}
+	size_t limit = usbfs_memory_limit();
+	if (limit != 0 && usbfs_memory_needed(&p, 1, false) > limit) {
+		dprintf(client, "ERROR: job needs %zu KiB of usbfs memory, "
+				"limit is %zu KiB\n",
+				usbfs_memory_needed(&p, 1, false) / 1024,
+				limit / 1024);
+		return 0;
+	}
+
+	if (d->passmark && p.mode != d->config.mode) {
+		struct u3loop_config config = d->config;
+		init_config(&config, p.mode, config.ep_type, config.speed);
+		config.polling_interval = d->config.polling_interval;
+
+		d->dev = u3dev_configure(d->dev, &config, d->vid, d->pid,
+				NULL, NULL);
+		if (d->dev == NULL) {
+			dprintf(client, "ERROR: device lost during configuration\n");
+			return -1;
+		}
+		prepare_device(d->dev, false);
+		d->config = config;
+
+		if (p.ep_type != U3LOOP_EP_TYPE_BULK) {
+			uint8_t ep = (p.mode == U3LOOP_MODE_WRITE) ? BULK_OUT : BULK_IN;
+			if (get_periodic_endpoint(d->dev, ep, &p.ep_bytes,
+						&p.ep_interval_usec) != 0)
+			{
+				dprintf(client, "ERROR: endpoint not available\n");
+				return 0;
+			}
+		}
+	}
+
+	struct state_t *state = calloc(1, sizeof(*state));
+	if (state == NULL) {
+		perror("calloc()");
+		dprintf(client, "ERROR: out of memory\n");
+		return 0;
+	}
+
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	if (saved_stdout == -1 || dup2(client, STDOUT_FILENO) == -1) {
+		perror("dup()");
+		dprintf(client, "ERROR: internal error\n");
+		goto fail;
+	}
+
+	if (run_test(d->dev, &p, state) == 0) {
+		print_report(state, csv);
+	} else {
+		printf("ERROR: test failed\n");
+	}
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+fail:
+	if (saved_stdout != -1) {
+		close(saved_stdout);
+	}
+	free(state);
+
+	return 0;
+}
+
+/**
+ * Accept and run jobs on a Unix socket until terminated
+ *
+ * Jobs are run one at a time in order of connection; every connection
+ * carries a single job.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int run_daemon(struct daemon_t *d, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+	int retval = -1;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	// Remove stale socket of previous run, but nothing else
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s exists and is not a socket\n", path);
+			return -1;
+		}
+		if (unlink(path) == -1) {
+			perror("unlink()");
+			return -1;
+		}
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		perror("socket()");
+		return -1;
+	}
+
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("bind()");
+		goto fail1;
+	}
+	if (listen(sock, 8) == -1) {
+		perror("listen()");
+		goto fail2;
+	}
+
+	// Clients disconnecting early must not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	if (verbose) {
+		printf("Waiting for jobs on %s\n", path);
+	}
+
+	while (!terminate) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR) continue;
+			perror("poll()");
+			goto fail2;
+		}
+
+		int client = accept(sock, NULL, NULL);
+		if (client == -1) {
+			if (errno == EINTR) continue;
+			perror("accept()");
+			goto fail2;
+		}
+
+		int err = run_job(d, client);
+		close(client);
+		if (err != 0) {
+			goto fail2;
 		}
 	}
+
+	retval = 0;
+fail2:
+	unlink(path);
+fail1:
+	close(sock);
+	return retval;
 }
 
 int main(int argc, char *argv[])
 {
-	struct libusb_device_handle *dev;
+	struct libusb_device_handle *devs[MAX_DEVICES] = { NULL };
+	char *dev_serials[MAX_DEVICES] = { NULL };
+	char *dev_paths[MAX_DEVICES] = { NULL };
+	int dev_cnt = 1;
+	int i;
 	int opt;
 	char *endp;
-	char *opt_serial_number = NULL;
-	time_t opt_time_limit;
+	time_t opt_time_limit = 0;
 	int opt_report_ival = DEFAULT_DISPLAY_IVAL;
-	int opt_speed = U3LOOP_SPEED_SUPER;
+	int opt_speed = 0;
 	int opt_mode = U3LOOP_MODE_READ_WRITE;
-	size_t opt_transfer_size = DEFAULT_TRANSFER_SIZE;
-	char *opt_dev_path = NULL;
+	size_t opt_transfer_size = 0;
+	bool opt_verify = false;
+	enum prbs_type opt_prbs = PRBS_NONE;
+	int opt_ep_type = U3LOOP_EP_TYPE_BULK;
+	unsigned int opt_iso_packets = DEFAULT_ISO_PACKETS;
+	unsigned int opt_poll_interval = 0;
+	char *opt_load_serial = NULL;
+	int opt_queue_depth = -1;
+	unsigned int opt_ctrl_depth = 0;
+	int opt_event_cpu = -1;
+	int opt_report_cpu = -1;
+	bool opt_usbfs = false;
+	enum buf_mode opt_buffers = BUF_AUTO;
+	bool opt_buffer_ab = false;
+	double opt_tx_rate = 0;
+	double opt_rx_rate = 0;
+	unsigned int opt_gaps_usec[MAX_GAPS];
+	unsigned int opt_gap_cnt = 0;
+	unsigned int opt_config_modes = 0;
+	unsigned int opt_matrix_modes = 0;
+	unsigned int opt_sweep_depth = 0;
+	size_t opt_sweep_size_min = 0;
+	size_t opt_sweep_size_max = 0;
+	bool opt_all_devices = false;
+	int serial_cnt = 0;
+	int path_cnt = 0;
 	uint16_t opt_vid = 0;
 	uint16_t opt_pid = 0;
 	struct test_device_type *opt_test_device = &(test_device_types[0]);
 	bool opt_csv = false;
 	int retval = EXIT_FAILURE;
 	int err;
-	ssize_t len;
-	int i;
-	struct state_t state = { 0 };
+	struct state_t *states = NULL;
+	struct bulk_load load = { 0 };
+	struct u3loop_config dev_config = { 0 };
+	char *opt_daemon_path = NULL;
 
-	while ((opt = getopt(argc, argv, "CD:i:I:l:m:s:S:t:T:vh")) != -1) {
+	while ((opt = getopt(argc, argv, "A:B:c:Cd:D:E:G:i:I:K:l:L:m:M:n:p:P:q:Q:r:s:S:t:T:UVvX:h")) != -1) {
 		switch (opt) {
+		case 'A':
+			opt_event_cpu = strtol(optarg, &endp, 10);
+			if (*endp == ',') {
+				opt_report_cpu = strtol(endp + 1, &endp, 10);
+			}
+			if (*endp != '\0' || opt_event_cpu < 0 || opt_report_cpu < -1) {
+				fprintf(stderr, "Argument to '-A' must be in format: CPU[,CPU]\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'B':
+			opt_load_serial = optarg;
+			break;
+		case 'c':
+			opt_ctrl_depth = strtoul(optarg, &endp, 10);
+			if (*endp != '\0') {
+				fprintf(stderr, "Argument to '-c' must be numeric\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'C':
 			opt_csv = true;
 			break;
+		case 'd':
+			opt_daemon_path = optarg;
+			break;
 		case 'D':
-			if (strlen(optarg) != 7 || optarg[3] != '.') {
-				fprintf(stderr, "Illegal device path\n");
+			path_cnt = split_list(optarg, dev_paths, MAX_DEVICES);
+			if (path_cnt <= 0) {
+				fprintf(stderr, "Argument to '-D' must be 1 to %d device paths\n", MAX_DEVICES);
+				exit(EXIT_FAILURE);
+			}
+			for (i=0; i < path_cnt; i++) {
+				if (strlen(dev_paths[i]) != 7 || dev_paths[i][3] != '.') {
+					fprintf(stderr, "Illegal device path\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			break;
+		case 'E':
+			if (strcasecmp(optarg, "bulk") == 0) {
+				opt_ep_type = U3LOOP_EP_TYPE_BULK;
+			} else if (strcasecmp(optarg, "iso") == 0) {
+				opt_ep_type = U3LOOP_EP_TYPE_ISO;
+			} else if (strcasecmp(optarg, "int") == 0) {
+				opt_ep_type = U3LOOP_EP_TYPE_INT;
+			} else {
+				fprintf(stderr, "Invalid argument for '-E' option\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'G':
+			endp = optarg;
+			opt_gap_cnt = 0;
+			do {
+				if (opt_gap_cnt == MAX_GAPS) {
+					fprintf(stderr, "Too many gaps, max. %d\n", MAX_GAPS);
+					exit(EXIT_FAILURE);
+				}
+				opt_gaps_usec[opt_gap_cnt++] = strtoul(endp, &endp, 10);
+			} while (*endp == ',' && *(++endp) != '\0');
+			if (*endp != '\0') {
+				fprintf(stderr, "Argument to '-G' must be a comma separated list of gaps in usec.\n");
 				exit(EXIT_FAILURE);
 			}
-			opt_dev_path = strdup(optarg);
 			break;
 		case 'i':
 			opt_report_ival = strtol(optarg, &endp, 10);
@@ -517,23 +4761,115 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "WARNING: transfer size not a multiple of 1024, this might not work\n");
 			}
 			break;
+		case 'L':
+			opt_sweep_size_min = strtoul(optarg, &endp, 10);
+			if (*endp != ':') {
+				fprintf(stderr, "Argument to '-L' must be in format: MIN:MAX\n");
+				exit(EXIT_FAILURE);
+			}
+			opt_sweep_size_max = strtoul(endp + 1, &endp, 10);
+			if (*endp != '\0' || opt_sweep_size_min == 0 ||
+			    opt_sweep_size_max < opt_sweep_size_min)
+			{
+				fprintf(stderr, "Argument to '-L' must be in format: MIN:MAX\n");
+				exit(EXIT_FAILURE);
+			}
+			if ((opt_sweep_size_min % 1024) || (opt_sweep_size_max % 1024)) {
+				// NOTE: cyfxbulksrcsink firmware 'hangs' if reading partial packets, default packet size is 1024
+				fprintf(stderr, "WARNING: transfer size not a multiple of 1024, this might not work\n");
+			}
+			break;
 		case 'm':
-			if (strcasecmp(optarg, "r") == 0) {
-				opt_mode = U3LOOP_MODE_READ;
-			} else if (strcasecmp(optarg, "w") == 0) {
-				opt_mode = U3LOOP_MODE_WRITE;
-			} else if (strcasecmp(optarg, "rw") == 0) {
-				opt_mode = U3LOOP_MODE_READ_WRITE;
-			} else {
+			opt_mode = parse_mode(optarg);
+			if (opt_mode < 0) {
 				fprintf(stderr, "Invalid argument for '-m' option\n");
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'K':
+			opt_config_modes = parse_modes(optarg);
+			if (opt_config_modes == 0) {
+				fprintf(stderr, "Argument to '-K' must be a comma separated list of modes or 'all'\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'M':
+			if (strcasecmp(optarg, "auto") == 0) {
+				opt_buffers = BUF_AUTO;
+			} else if (strcasecmp(optarg, "dev") == 0) {
+				opt_buffers = BUF_DEV_MEM;
+			} else if (strcasecmp(optarg, "malloc") == 0) {
+				opt_buffers = BUF_MALLOC;
+			} else if (strcasecmp(optarg, "huge") == 0) {
+				opt_buffers = BUF_HUGE;
+			} else if (strcasecmp(optarg, "ab") == 0) {
+				opt_buffer_ab = true;
+			} else {
+				fprintf(stderr, "Invalid argument for '-M' option\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'n':
+			opt_iso_packets = strtoul(optarg, &endp, 10);
+			if (*endp != '\0' || opt_iso_packets == 0) {
+				fprintf(stderr, "Argument to '-n' must be a positive number\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+			opt_poll_interval = strtoul(optarg, &endp, 10);
+			if (*endp != '\0' || opt_poll_interval == 0 || opt_poll_interval > 255) {
+				fprintf(stderr, "Argument to '-p' must be a number from 1 to 255\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'P':
+			opt_prbs = prbs_parse(optarg);
+			if (opt_prbs == PRBS_NONE) {
+				fprintf(stderr, "Invalid argument for '-P' option\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'q':
+			opt_queue_depth = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || opt_queue_depth < 0) {
+				fprintf(stderr, "Argument to '-q' must be a positive number or 0\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			opt_tx_rate = strtod(optarg, &endp);
+			opt_rx_rate = opt_tx_rate;
+			if (*endp == ',') {
+				opt_rx_rate = strtod(endp + 1, &endp);
+			}
+			if (*endp != '\0' || opt_tx_rate < 0 || opt_rx_rate < 0) {
+				fprintf(stderr, "Argument to '-r' must be in format: RATE[,RATE]\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'Q':
+			opt_sweep_depth = strtoul(optarg, &endp, 10);
+			if (*endp != '\0' || opt_sweep_depth == 0) {
+				fprintf(stderr, "Argument to '-Q' must be a positive number\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 's':
-			opt_serial_number = optarg;
+			if (strcmp(optarg, "all") == 0) {
+				opt_all_devices = true;
+				break;
+			}
+			serial_cnt = split_list(optarg, dev_serials, MAX_DEVICES);
+			if (serial_cnt <= 0) {
+				fprintf(stderr, "Argument to '-s' must be 1 to %d serial numbers or 'all'\n", MAX_DEVICES);
+				exit(EXIT_FAILURE);
+			}
 			break;
 		case 'S':
-			if (strcasecmp(optarg, "fs") == 0) {
+			if (strcasecmp(optarg, "auto") == 0) {
+				opt_speed = 0;
+			} else if (strcasecmp(optarg, "fs") == 0) {
 				opt_speed = U3LOOP_SPEED_FULL;
 			} else if (strcasecmp(optarg, "hs") == 0) {
 				opt_speed = U3LOOP_SPEED_HIGH;
@@ -571,6 +4907,19 @@ int main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'U':
+			opt_usbfs = true;
+			break;
+		case 'X':
+			opt_matrix_modes = parse_modes(optarg);
+			if (opt_matrix_modes == 0) {
+				fprintf(stderr, "Argument to '-X' must be a comma separated list of modes or 'all'\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'V':
+			opt_verify = true;
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -588,13 +4937,170 @@ int main(int argc, char *argv[])
 		opt_vid = opt_test_device->vid;
 		opt_pid = opt_test_device->pid;
 	}
-	if (opt_test_device->id == TEST_DEV_PASSMARK && opt_dev_path != NULL) {
-		// Device reenumerates after configuration, so the path changes.
-		// TODO: implement that the serial number is remembered after 1st open, and use that for second open.
-		fprintf(stderr, "Error: using dev path to specify a target passmark device isn't supported at the moment.\n");
+	if (opt_all_devices && path_cnt > 0) {
+		fprintf(stderr, "'-s all' and '-D' can not be used at a time\n");
+		exit(EXIT_FAILURE);
+	}
+	if (serial_cnt > 0 && path_cnt > 0 && (serial_cnt > 1 || path_cnt > 1)) {
+		fprintf(stderr, "Multiple devices must be given either by '-s' or by '-D'\n");
+		exit(EXIT_FAILURE);
+	}
+	if (serial_cnt > 1 || path_cnt > 1) {
+		dev_cnt = (serial_cnt > path_cnt) ? serial_cnt : path_cnt;
+	}
+	if ((dev_cnt > 1 || opt_all_devices) &&
+	    (opt_daemon_path != NULL || opt_sweep_depth > 0 ||
+	     opt_sweep_size_max > 0 || opt_buffer_ab))
+	{
+		fprintf(stderr, "'-d', '-Q', '-L' and '-M ab' can only be used with a single device\n");
 		exit(EXIT_FAILURE);
 	}
+	if (opt_daemon_path != NULL &&
+	    (opt_sweep_depth > 0 || opt_sweep_size_max > 0 || opt_load_serial != NULL))
+	{
+		fprintf(stderr, "'-d' can not be used with '-Q', '-L' or '-B'\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_sweep_depth > 0 && opt_sweep_size_max > 0) {
+		fprintf(stderr, "'-Q' and '-L' can not be used at a time\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_buffer_ab &&
+	    (opt_sweep_depth > 0 || opt_sweep_size_max > 0 || opt_daemon_path != NULL))
+	{
+		fprintf(stderr, "'-M ab' can not be used with '-Q', '-L' or '-d'\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_mode == U3LOOP_MODE_LOOPBACK && opt_test_device->id != TEST_DEV_PASSMARK) {
+		fprintf(stderr, "Loopback mode is only supported by passmark devices\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_verify && opt_mode != U3LOOP_MODE_LOOPBACK) {
+		// In other modes the device sources/sinks the data itself
+		fprintf(stderr, "'-V' requires loopback mode\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_prbs != PRBS_NONE && opt_verify) {
+		fprintf(stderr, "'-P' and '-V' can not be used at a time\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_prbs != PRBS_NONE && opt_mode == U3LOOP_MODE_READ) {
+		fprintf(stderr, "'-P' requires a mode that writes data\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_ep_type == U3LOOP_EP_TYPE_ISO) {
+		if (opt_test_device->id != TEST_DEV_PASSMARK) {
+			fprintf(stderr, "Isochronous endpoints are only supported by passmark devices\n");
+			exit(EXIT_FAILURE);
+		}
+		// Packets can be lost or short, which breaks the data stream
+		if (opt_verify || opt_prbs != PRBS_NONE) {
+			fprintf(stderr, "'-V' and '-P' can not be used with isochronous endpoints\n");
+			exit(EXIT_FAILURE);
+		}
+		// Transfer size follows from the packet count
+		if (opt_transfer_size != 0 || opt_sweep_size_max > 0) {
+			fprintf(stderr, "'-l' and '-L' can not be used with isochronous endpoints, use '-n'\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (opt_ep_type == U3LOOP_EP_TYPE_INT) {
+		if (opt_test_device->id != TEST_DEV_PASSMARK) {
+			fprintf(stderr, "Interrupt endpoints are only supported by passmark devices\n");
+			exit(EXIT_FAILURE);
+		}
+		// Transfer size is one service interval
+		if (opt_transfer_size != 0 || opt_sweep_size_max > 0) {
+			fprintf(stderr, "'-l' and '-L' can not be used with interrupt endpoints\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ((opt_poll_interval != 0 || opt_load_serial != NULL) &&
+	    opt_test_device->id != TEST_DEV_PASSMARK)
+	{
+		fprintf(stderr, "'-p' and '-B' are only supported by passmark devices\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_usbfs) {
+		if (opt_ep_type != U3LOOP_EP_TYPE_BULK || opt_ctrl_depth > 0) {
+			fprintf(stderr, "'-U' only supports bulk transfers, not '-E' or '-c'\n");
+			exit(EXIT_FAILURE);
+		}
+		// Load is driven by the libusb event loop, which doesn't run
+		if (dev_cnt > 1 || opt_all_devices || opt_load_serial != NULL) {
+			fprintf(stderr, "'-U' can only be used with a single device and without '-B'\n");
+			exit(EXIT_FAILURE);
+		}
+		// usbfs maps its buffers itself when possible
+		if (opt_buffers != BUF_AUTO || opt_buffer_ab) {
+			fprintf(stderr, "'-U' and '-M' can not be used at a time\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ((opt_tx_rate > 0 || opt_rx_rate > 0) &&
+	    (opt_ep_type != U3LOOP_EP_TYPE_BULK || opt_usbfs))
+	{
+		// Periodic endpoints are already paced by their service interval
+		fprintf(stderr, "'-r' only supports bulk transfers using libusb, not '-E' or '-U'\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_config_modes != 0 || opt_matrix_modes != 0) {
+		// Both re-configure the device for every step
+		const char *opt_name = (opt_config_modes != 0) ? "-K" : "-X";
+		if (opt_config_modes != 0 && opt_matrix_modes != 0) {
+			fprintf(stderr, "'-K' and '-X' can't be combined\n");
+			exit(EXIT_FAILURE);
+		}
+		if (opt_test_device->id != TEST_DEV_PASSMARK) {
+			fprintf(stderr, "'%s' is only supported by passmark devices\n",
+					opt_name);
+			exit(EXIT_FAILURE);
+		}
+		if (opt_ep_type != U3LOOP_EP_TYPE_BULK || opt_usbfs ||
+		    opt_gap_cnt > 0 || opt_tx_rate > 0 || opt_rx_rate > 0)
+		{
+			fprintf(stderr, "'%s' only supports bulk transfers using libusb, not '-E', '-U', '-G' or '-r'\n",
+					opt_name);
+			exit(EXIT_FAILURE);
+		}
+		if (dev_cnt > 1 || opt_all_devices || opt_daemon_path != NULL ||
+		    opt_sweep_depth > 0 || opt_sweep_size_max > 0 || opt_buffer_ab)
+		{
+			fprintf(stderr, "'%s' can only be used with a single device, not with '-d', '-L', '-Q' or '-M ab'\n",
+					opt_name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (opt_gap_cnt > 0) {
+		if (opt_ep_type != U3LOOP_EP_TYPE_BULK || opt_ctrl_depth > 0 ||
+		    opt_usbfs || opt_tx_rate > 0 || opt_rx_rate > 0)
+		{
+			fprintf(stderr, "'-G' only supports bulk transfers using libusb, not '-E', '-c', '-U' or '-r'\n");
+			exit(EXIT_FAILURE);
+		}
+		if (dev_cnt > 1 || opt_all_devices || opt_daemon_path != NULL ||
+		    opt_sweep_depth > 0 || opt_sweep_size_max > 0 || opt_buffer_ab)
+		{
+			fprintf(stderr, "'-G' can only be used with a single device, not with '-d', '-L', '-Q' or '-M ab'\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (opt_prbs != PRBS_NONE && verbose) {
+		printf("Using %s PRBS implementation\n", prbs_impl_name());
+	}
 	if (opt_csv) opt_report_ival = 0;
+	if (opt_queue_depth == 0 && opt_ctrl_depth == 0) {
+		fprintf(stderr, "'-q 0' requires control transfers, see '-c'\n");
+		exit(EXIT_FAILURE);
+	}
+	bool depth_fixed = (opt_queue_depth >= 0);
+	bool size_fixed = (opt_transfer_size != 0);
+	if (opt_queue_depth < 0) {
+		opt_queue_depth = default_queue_depth(opt_mode);
+	}
+	if (opt_transfer_size == 0) {
+		opt_transfer_size = default_transfer_size(opt_mode);
+	}
 
 	signal(SIGTERM, &terminator);
 	signal(SIGINT, &terminator);
@@ -612,301 +5118,288 @@ int main(int argc, char *argv[])
 	libusb_set_debug(NULL, verbose);
 #endif
 
+	// After libusb_init(), so its internal threads don't inherit the CPU
+	if (opt_report_cpu >= 0 && pin_thread(opt_report_cpu, NULL) != 0) {
+		goto fail1;
+	}
 
-	// Find device and open it
-	if (verbose >= 2) {
-		printf("Looking for device of type '%s', id: %04x:%04x, sn: %s\n",
-				opt_test_device->name,
-				opt_vid, opt_pid,
-				(opt_serial_number != NULL) ?
-					opt_serial_number : "*");
+
+	if (opt_all_devices) {
+		dev_cnt = list_serials(opt_vid, opt_pid, opt_load_serial,
+				dev_serials, MAX_DEVICES);
+		if (dev_cnt <= 0) {
+			fprintf(stderr, "Unable to find usable loopback plug\n");
+			goto fail1;
+		}
 	}
-	dev = open_device(opt_dev_path, opt_vid, opt_pid, opt_serial_number);
-	if (dev == NULL) {
-		fprintf(stderr, "Unable to find usable loopback plug\n");
+
+	states = calloc(dev_cnt, sizeof(*states));
+	if (states == NULL) {
+		perror("calloc()");
 		goto fail1;
 	}
 
-	if (opt_test_device->id == TEST_DEV_PASSMARK) {
-		// Configure device
-		struct u3loop_config dev_config = {
-			.mode = opt_mode,
-			.ep_type = U3LOOP_EP_TYPE_BULK,
-			.ep_in = BULK_IN & LIBUSB_ENDPOINT_ADDRESS_MASK,
-			.ep_out = BULK_OUT & LIBUSB_ENDPOINT_ADDRESS_MASK,
-			.ss_burst_len = 0x10,
-			.polling_interval = 0x01,
-			.hs_bulk_nak_interval = 0x00,
-			.iso_transactions_per_bus_interval = 0x03,
-			.iso_bytes_per_bus_interval = htole16(0xC000), // Depends on burst length
-			.speed = opt_speed,
-			.buffer_count = 0x02, // from USB3Test
-			.buffer_size = htole16(0xc000) // 0xc000 for read or write; 0x6000 for read and write
-		};
-		if (opt_mode == U3LOOP_MODE_READ_WRITE) {
-			dev_config.buffer_size = htole16(0x6000);
-		}
-		len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
-				U3LOOP_CMD_SET_CONFIG, 0,
-				(unsigned char *) &dev_config, sizeof(dev_config),
-				USB_TIMEOUT);
-		if (len < LIBUSB_SUCCESS) {
-			fprintf(stderr, "Failed to configure device for test: %s\n",
-					libusb_error_name(len));
+	// Find devices and open them
+	for (i=0; i < dev_cnt; i++) {
+		if (verbose >= 2) {
+			printf("Looking for device of type '%s', id: %04x:%04x, sn: %s\n",
+					opt_test_device->name,
+					opt_vid, opt_pid,
+					(dev_serials[i] != NULL) ?
+						dev_serials[i] : "*");
+		}
+		devs[i] = u3dev_open(dev_paths[i], opt_vid, opt_pid,
+				dev_serials[i]);
+		if (devs[i] == NULL) {
+			fprintf(stderr, "Unable to find usable loopback plug\n");
 			goto fail2;
 		}
-		libusb_release_interface(dev, IFNUM);
-		libusb_close(dev);
-		dev = NULL;
-
-		if (verbose) {
-			printf("Waiting for device to re-enumrate\n");
+		if (dev_cnt > 1) {
+			states[i].name = (dev_serials[i] != NULL) ?
+						dev_serials[i] : dev_paths[i];
 		}
+	}
 
-		for (i=0; dev == NULL && i < MAX_DEVICE_WAIT; i++) {
-			sleep(1);
-			// FIXME: if multiple adapters are connected; and no
-			// opt_serial_number is specified this breaks!!! get serial of
-			// previously opened device...
-			dev = open_device(opt_dev_path, opt_vid, opt_pid, opt_serial_number);
-		}
+	if (opt_test_device->id == TEST_DEV_PASSMARK) {
+		// Configure devices
+		for (i=0; i < dev_cnt; i++) {
+			devs[i] = setup_device(devs[i], &dev_config, opt_mode,
+					opt_ep_type, opt_speed,
+					opt_poll_interval, opt_vid, opt_pid,
+					dev_serials[i], states[i].name, opt_csv);
+			if (devs[i] == NULL) {
+				goto fail2;
+			}
 
-		if (dev == NULL) {
-			fprintf(stderr, "Timeout waiting for device to re-enumerate\n");
-			goto fail1;
+			// Bursts are meant to measure the LPM exit latency
+			prepare_device(devs[i], opt_gap_cnt > 0);
 		}
+	}
 
-		// Disable Link Power Management
-		len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
-				U3LOOP_CMD_CONF_LPM | U3LOOP_LPM_ENTRY_DISABLE,
-				0, NULL, 0, USB_TIMEOUT);
-		if (len < LIBUSB_SUCCESS) {
-			fprintf(stderr, "Warning: Failed to set LPM entry mode: %s\n",
-					libusb_error_name(len));
+	if (opt_load_serial != NULL) {
+		// Second device on the same host controller, generating load
+		load.dev = u3dev_open(NULL, opt_vid, opt_pid, opt_load_serial);
+		if (load.dev == NULL) {
+			fprintf(stderr, "Unable to find load device\n");
+			goto fail2;
 		}
 
-		/*
-		// Enable Error counters
-		struct u3loop_error_cfg err_cfg = {
-			.phy_err_mask = htole16(0x1ff),
-			.ll_err_mask = htole16(0x7fff)
-		};
-		len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
-				U3LOOP_CMD_CONF_ERROR_COUNTERS, 0,
-				(unsigned char *) &err_cfg, sizeof(err_cfg),
-				USB_TIMEOUT);
-		if (len < LIBUSB_SUCCESS) {
-			fprintf(stderr, "Warning: Unable to enable error counters:"
-					" %s\n", libusb_error_name(len));
-		}
-		len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
-				U3LOOP_CMD_RESET_ERROR_COUNTERS,
-				0, NULL, 0, USB_TIMEOUT);
-		if (len < LIBUSB_SUCCESS) {
-			fprintf(stderr, "Warning: Unable to reset error counters: "
-					"%s\n", libusb_error_name(len));
+		struct u3loop_config load_config;
+		load.dev = setup_device(load.dev, &load_config,
+				U3LOOP_MODE_READ_WRITE, U3LOOP_EP_TYPE_BULK,
+				opt_speed, 0, opt_vid, opt_pid,
+				opt_load_serial, "Load", true);
+		if (load.dev == NULL) {
+			goto fail2;
 		}
-		*/
 
-		// Disable LCD display during test
-		len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
-				U3LOOP_CMD_SET_DISPLAY_MODE | U3LOOP_DISPLAY_DISABLE,
-				0, NULL, 0, USB_TIMEOUT);
-		if (len < LIBUSB_SUCCESS) {
-			fprintf(stderr, "Warning: Failed to set display mode: %s\n",
-					libusb_error_name(len));
+		if (start_load(&load) != 0) {
+			goto fail3;
 		}
 	}
 
-	// Get start time
-	if (clock_gettime(CLOCK_MONOTONIC, &(state.start_time)) == -1) {
-		perror("clock_gettime");
-		goto fail2;
+	// Run test
+	struct test_params params = {
+		.mode = opt_mode,
+		.transfer_size = opt_transfer_size,
+		.depth_in = opt_queue_depth,
+		.depth_out = opt_queue_depth,
+		.time_limit = opt_time_limit,
+		.warmup_ms = 0,
+		.report_ival = opt_report_ival,
+		.verify = opt_verify,
+		.prbs = opt_prbs,
+		.ep_type = opt_ep_type,
+		.iso_packets = opt_iso_packets,
+		.ctrl_depth = opt_ctrl_depth,
+		.event_cpu = opt_event_cpu,
+		.usbfs = opt_usbfs,
+		.buffers = opt_buffers,
+		.tx_rate = opt_tx_rate,
+		.rx_rate = opt_rx_rate,
+		.gap_cnt = opt_gap_cnt,
+		.telemetry = (opt_test_device->id == TEST_DEV_PASSMARK && !opt_usbfs),
+	};
+	memcpy(params.gaps_usec, opt_gaps_usec,
+			opt_gap_cnt * sizeof(*opt_gaps_usec));
+	if (opt_test_device->id == TEST_DEV_PASSMARK) {
+		params.ctrl_setup = (struct libusb_control_setup) {
+			.bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN,
+			.bRequest = 0,
+			.wValue = U3LOOP_CMD_GET_CONFIG,
+			.wIndex = 0,
+			.wLength = sizeof(struct u3loop_config)
+		};
+	} else {
+		// Standard GET_STATUS, supported by any device
+		params.ctrl_setup = (struct libusb_control_setup) {
+			.bmRequestType = LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_ENDPOINT_IN,
+			.bRequest = LIBUSB_REQUEST_GET_STATUS,
+			.wValue = 0,
+			.wIndex = 0,
+			.wLength = 2
+		};
 	}
-	state.measurement_time = state.start_time;
-
-	// Allocate and submit USB transfers
-	int use_dev_mem = -1;
-	struct libusb_transfer *xfers[BUFFER_CNT];
-	memset(xfers, 0, sizeof(xfers));
-	for (i=0; (size_t) i < ARRAY_SIZE(xfers); i++) {
-		xfers[i] = libusb_alloc_transfer(0);
-		if (xfers[i] == NULL) {
-			fprintf(stderr, "Failed to allocate transfer\n");
-			goto fail3;
-		}
-
-		uint8_t *buf = NULL;
-#if LIBUSB_API_VERSION >= 0x01000105 && WITH_USE_DEV_MEM
-		if (use_dev_mem) {
-			buf = (uint8_t *) libusb_dev_mem_alloc(opt_transfer_size);
-			if (buf == NULL) {
-				if (use_dev_mem == -1) {
-					// If first time allocation fails then
-					// DMA is probably not supported on
-					// this platform. So disable.
-					if (verbose) printf("DMA not supported,"
-						" using malloc() instead\n");
-					use_dev_mem = 0;
-				} else {
-					fprintf(stderr, "Failed to allocate "
-							"DMA buffer\n");
-					libusb_free_transfer(xfers[i]);
-					xfers[i] = NULL;
-					goto fail3;
-				}
-			} else {
-				if (verbose) printf("DMA supported, using "
-						"libusb_dev_mem_alloc()\n");
-				use_dev_mem = 1;
-			}
-		}
-#else
-		(void) use_dev_mem;
-#endif // LIBUSB_API_VERSION >= 0x01000105 && WITH_USE_DEV_MEM
-
-		if (buf == NULL) {
-			buf = (uint8_t *) malloc(opt_transfer_size);
-			if (buf == NULL) {
-				perror("malloc()");
-				libusb_free_transfer(xfers[i]);
-				xfers[i] = NULL;
+	if (opt_ep_type != U3LOOP_EP_TYPE_BULK) {
+		// All devices are configured the same, so have the same
+		// endpoints
+		uint8_t ep = (opt_mode == U3LOOP_MODE_WRITE) ? BULK_OUT : BULK_IN;
+		for (i=0; i < dev_cnt; i++) {
+			if (get_periodic_endpoint(devs[i], ep, &params.ep_bytes,
+						&params.ep_interval_usec) != 0)
+			{
 				goto fail3;
 			}
 		}
+	}
 
-		memset(buf, 0xC5, opt_transfer_size);
-
-		// Determine endpoint
-		int ep;
-		if (opt_mode == U3LOOP_MODE_READ) {
-			ep = BULK_IN;
-		} else if (opt_mode == U3LOOP_MODE_WRITE) {
-			ep = BULK_OUT;
-		} else if (opt_mode == U3LOOP_MODE_READ_WRITE) {
-			if (i & 1) {
-				ep = BULK_OUT;
-			} else {
-				ep = BULK_IN;
-			}
+	// Make the test fit in the memory usbfs is allowed to pin, instead of
+	// failing halfway through submitting transfers
+	size_t usbfs_limit = usbfs_memory_limit();
+	if (usbfs_limit != 0) {
+		bool load_running = (opt_load_serial != NULL);
+		struct test_params largest = params;
+		if (opt_sweep_depth > 0) {
+			largest.depth_in = opt_sweep_depth;
+			largest.depth_out = opt_sweep_depth;
+		} else if (opt_sweep_size_max > 0) {
+			largest.transfer_size = opt_sweep_size_max;
 		}
+		size_t needed = usbfs_memory_needed(&largest, dev_cnt,
+				load_running);
 
-		libusb_fill_bulk_transfer(xfers[i], dev, ep, buf,
-				opt_transfer_size, transfer_cb, &state, USB_TIMEOUT);
-
-		err = libusb_submit_transfer(xfers[i]);
-		if (err == LIBUSB_SUCCESS) {
-			state.active_transfers++;
-		} else {
-			fprintf(stderr, "Failed to submit transfer: %s\n", libusb_strerror(err));
+		if (opt_sweep_depth > 0 || opt_sweep_size_max > 0) {
+			// Sweep range is given explicitly, don't change it
+			if (needed > usbfs_limit) {
+				print_usbfs_memory_error(needed, usbfs_limit);
+				goto fail3;
+			}
+		} else if (fit_usbfs_memory(&params, dev_cnt, load_running,
+					usbfs_limit, size_fixed, depth_fixed) != 0)
+		{
+			print_usbfs_memory_error(needed, usbfs_limit);
 			goto fail3;
+		} else if (!opt_csv && needed > usbfs_limit) {
+			printf("Reduced transfer size to %zu and queue depth to "
+				"%u/%u to fit usbfs memory limit of %zu MiB\n",
+				params.transfer_size, params.depth_in,
+				params.depth_out, usbfs_limit / (1024 * 1024));
 		}
 	}
-
-
-	if (opt_report_ival > 0) {
-		printf("Time, Ops, "
-			"Speed(mbps), Avg. Speed(mbps), "
-			"TX Speed(mbps), TX Avg. Speed(mbps), "
-			"RX Speed(mbps), RX Avg. Speed(mbps), "
-			"Host Error count\n");
-	}
-
-	// Main loop
-	bool take_measurement = false;
-	struct timeval onesec = { 1, 0 };
-	time_t last_time_running = 0;
-	while (!terminate) {
-		err = libusb_handle_events_timeout_completed(NULL, &onesec, &terminate);
-
-		// Service periodic things, every second
-		// TODO: use timer to set _take_measurement_. To prevent
-		// calling clock_gettime() a lot on platforms that still use a
-		// slow library/kernel call for this.
-		struct timespec now;
-		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
-			perror("clock_gettime");
+	if (opt_daemon_path != NULL) {
+		struct daemon_t daemon = {
+			.dev = devs[0],
+			.passmark = (opt_test_device->id == TEST_DEV_PASSMARK),
+			.config = dev_config,
+			.vid = opt_vid,
+			.pid = opt_pid,
+			.defaults = params,
+			.csv = opt_csv,
+		};
+		err = run_daemon(&daemon, opt_daemon_path);
+		devs[0] = daemon.dev;
+		if (devs[0] == NULL) {
+			goto fail2;
+		}
+		if (err != 0) {
 			goto fail3;
 		}
-		time_t time_running =  now.tv_sec - state.start_time.tv_sec;
-		if (now.tv_nsec < state.start_time.tv_nsec) {
-			time_running -= 1;
+	} else if (opt_sweep_depth > 0 || opt_sweep_size_max > 0 ||
+		   opt_buffer_ab || opt_config_modes != 0 ||
+		   opt_matrix_modes != 0)
+	{
+		params.warmup_ms = SWEEP_WARMUP_MS;
+		params.report_ival = 0;
+		if (params.time_limit == 0) {
+			params.time_limit = DEFAULT_SWEEP_TIME;
 		}
 
-		if (time_running != last_time_running) {
-			last_time_running = time_running;
-			if (opt_time_limit > 0 && time_running >= opt_time_limit) {
-				terminate = true;
+		if (opt_matrix_modes != 0) {
+			err = run_speed_matrix(&devs[0], &dev_config, &params,
+					opt_matrix_modes, depth_fixed,
+					size_fixed, opt_vid, opt_pid, opt_csv);
+			if (devs[0] == NULL) {
+				goto fail2;
 			}
-
-			if (opt_report_ival > 0 && time_running % opt_report_ival == 0) {
-				take_measurement = true;
+		} else if (opt_config_modes != 0) {
+			err = run_config_sweep(&devs[0], &dev_config, &params,
+					opt_config_modes, depth_fixed,
+					size_fixed, opt_vid, opt_pid, opt_csv);
+			if (devs[0] == NULL) {
+				goto fail2;
 			}
+		} else if (opt_buffer_ab) {
+			err = run_buffer_ab(devs[0], &params, opt_csv);
+		} else if (opt_sweep_depth > 0) {
+			err = run_depth_sweep(devs[0], &params, opt_sweep_depth, opt_csv);
+		} else {
+			err = run_size_sweep(devs[0], &params, opt_sweep_size_min,
+					opt_sweep_size_max, opt_csv);
 		}
-
-		// Take Measurement
-		if (take_measurement || (terminate && opt_report_ival != 0)) {
-			take_measurement = false;
-
-			// Print measurement
-			print_measurement(&state);
+		if (err != 0) {
+			goto fail3;
+		}
+	} else if (opt_gap_cnt > 0) {
+		if (run_burst_test(devs[0], &params, &states[0], opt_csv) != 0) {
+			goto fail3;
+		}
+	} else if (dev_cnt > 1) {
+		struct test_run runs[MAX_DEVICES] = { 0 };
+		for (i=0; i < dev_cnt; i++) {
+			runs[i].dev = devs[i];
+			runs[i].state = &states[i];
+		}
+		if (run_tests(runs, dev_cnt, &params) != 0) {
+			goto fail3;
 		}
 
-		if (!terminate && state.active_transfers != ARRAY_SIZE(xfers)) {
-			// Detect if there was an error resubmitting transfers
-			fprintf(stderr, "Some transfers could not be resubmitted, aborting\n");
+		// Cumulative error report per device and total
+		for (i=0; i < dev_cnt; i++) {
+			print_report(&states[i], opt_csv);
+		}
+		print_aggregate(states, dev_cnt, opt_csv);
+	} else {
+		if (run_test(devs[0], &params, &states[0]) != 0) {
 			goto fail3;
 		}
-	}
 
-	// Cumulative error report
-	print_report(&state, opt_csv);
+		// Cumulative error report
+		print_report(&states[0], opt_csv);
+	}
 
 	retval = EXIT_SUCCESS;
 
 fail3:
-	// Cancel all submitted transfers
-	for (i=0; (size_t) i < ARRAY_SIZE(xfers); i++) {
-		if (xfers[i] != NULL) {
-			libusb_cancel_transfer(xfers[i]);
+	if (load.dev != NULL) {
+		stop_load(&load);
+		if (!opt_csv && retval == EXIT_SUCCESS) {
+			uint64_t usec = elapsed_usec(&load.start_time, &load.stop_time);
+			printf("\nBackground load: %.2f Mbit/s\n",
+				usec ? (double) load.bytes * 8 / usec : 0);
 		}
+		libusb_release_interface(load.dev, IFNUM);
+		libusb_close(load.dev);
 	}
-	// TODO: add timeout
-	while (state.active_transfers != 0) {
-		libusb_handle_events(NULL);
-	}
+fail2:
+	for (i=0; i < dev_cnt; i++) {
+		if (devs[i] == NULL) continue;
 
-	// Free transfers
-	for (i=0; (size_t) i < ARRAY_SIZE(xfers); i++) {
-		if (xfers[i] == NULL) continue;
-		if (xfers[i]->buffer == NULL) continue;
+		if (opt_test_device->id == TEST_DEV_PASSMARK) {
+			// Enable LCD display again
+			libusb_control_transfer(devs[i], LIBUSB_REQUEST_TYPE_VENDOR, 0,
+					U3LOOP_CMD_SET_DISPLAY_MODE | U3LOOP_DISPLAY_ENABLE,
+					0, NULL, 0, USB_TIMEOUT);
 
-#if LIBUSB_API_VERSION >= 0x01000105 && WITH_USE_DEV_MEM
-		if (use_dev_mem) {
-			libusb_dev_mem_free(xfers[i]->buffer);
-		} else
-#endif // LIBUSB_API_VERSION >= 0x01000105 && WITH_USE_DEV_MEM
-		{
-			free(xfers[i]->buffer);
+			// Enable Link Power Management
+			libusb_control_transfer(devs[i], LIBUSB_REQUEST_TYPE_VENDOR, 0,
+					U3LOOP_CMD_CONF_LPM | U3LOOP_LPM_ENTRY_ENABLE,
+					0, NULL, 0, USB_TIMEOUT);
 		}
 
-		libusb_free_transfer(xfers[i]);
-	}
-fail2:
-	if (opt_test_device->id == TEST_DEV_PASSMARK) {
-		// Enable LCD display again
-		libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
-				U3LOOP_CMD_SET_DISPLAY_MODE | U3LOOP_DISPLAY_ENABLE,
-				0, NULL, 0, USB_TIMEOUT);
-
-		// Enable Link Power Management
-		libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
-				U3LOOP_CMD_CONF_LPM | U3LOOP_LPM_ENTRY_ENABLE,
-				0, NULL, 0, USB_TIMEOUT);
+		libusb_release_interface(devs[i], IFNUM);
+		libusb_close(devs[i]);
 	}
-
-	libusb_release_interface(dev, IFNUM);
-	libusb_close(dev);
+	free(states);
 fail1:
 	libusb_exit(NULL);
 fail0:
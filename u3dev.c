@@ -0,0 +1,364 @@
+/**
+ * u3dev.c - PassMark device setup, shared by u3loop and u3bench
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "u3dev.h"
+
+#define IFNUM 0
+#define USB_TIMEOUT 2000	//2000 millisecs == 2 seconds 
+#define MAX_DEVICE_WAIT 10	// Time in seconds to wait for re-enumration
+#define REENUM_POLL_MS 10	// Device list poll interval while waiting for re-enumeration
+
+volatile sig_atomic_t u3dev_stop = false;
+
+struct libusb_device_handle *u3dev_open(const char *dev_path,
+		uint16_t vid, uint16_t pid, const char *serial_number)
+{
+	struct libusb_device_handle *dev;
+	libusb_device **devs;
+	ssize_t cnt;
+	int i;
+	int err;
+
+	// If a device path is specified parse it.
+	uint8_t bus = 0;
+	uint8_t dev_num = 0;
+	if (dev_path != NULL) {
+		bus = strtoul(dev_path, NULL, 10);
+		dev_num = strtoul(&dev_path[4], NULL, 10);
+		// Assume both bus and dev_num start counting at 1
+		if (dev_num == 0) {
+			bus = 0;
+		}
+	}
+
+	cnt = libusb_get_device_list(NULL, &devs);
+	if (cnt < 0) {
+		fprintf(stderr, "Failed to get USB device list: %s\n",
+				libusb_error_name(cnt));
+		return NULL;
+	}
+
+	bool found = false;
+	for (i=0; i < cnt && !found; i++) {
+		struct libusb_device_descriptor desc;
+		err = libusb_get_device_descriptor(devs[i], &desc);
+		if (err != LIBUSB_SUCCESS) {
+			continue;
+		}
+
+		if (bus != 0) {
+			if (bus != libusb_get_bus_number(devs[i]) ||
+			    dev_num != libusb_get_device_address(devs[i])) {
+				continue;
+			}
+		} else if (desc.idVendor != vid ||
+			   desc.idProduct != pid)
+		{
+			continue;
+		}
+
+		err = libusb_open(devs[i], &dev);
+		if (err != LIBUSB_SUCCESS) {
+			if (verbose) {
+				fprintf(stderr, "Unable to open device: %s\n", libusb_error_name(err));
+			}
+			continue;
+		}
+
+		char serial_str[256];
+		err = libusb_get_string_descriptor_ascii(dev,
+					desc.iSerialNumber,
+					(unsigned char *)serial_str,
+					sizeof(serial_str));
+		if (err == LIBUSB_SUCCESS) {
+			if (verbose) {
+				fprintf(stderr, "Unable to get serial number: %s\n", libusb_error_name(err));
+			}
+			libusb_close(dev);
+			continue;
+		}
+
+		if (serial_number == NULL ||
+				strcmp(serial_str, serial_number) == 0)
+		{
+			found = true;
+			if (verbose) {
+				printf("Found Device @ bus: %u, device: %u, s/n: %s\n",
+						       libusb_get_bus_number(devs[i]),
+						       libusb_get_device_address(devs[i]),
+						       serial_str);
+			}
+		} else {
+			libusb_close(dev);
+		}
+	}
+	libusb_free_device_list(devs, 1);
+
+	if (!found) {
+		return NULL;
+	}
+
+	err = libusb_claim_interface(dev, IFNUM);
+	if (err != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Failed to claim device interface: %s\n",
+				libusb_error_name(err));
+		libusb_close(dev);
+		return NULL;
+	}
+
+	return dev;
+}
+
+uint64_t elapsed_usec(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int LIBUSB_CALL arrived_cb(__attribute__((unused)) libusb_context *ctx,
+		__attribute__((unused)) libusb_device *device,
+		__attribute__((unused)) libusb_hotplug_event event,
+		void *user_data)
+{
+	*(int *) user_data = true;
+	return 0;
+}
+
+struct libusb_device_handle *u3dev_configure(struct libusb_device_handle *dev,
+		const struct u3loop_config *config,
+		uint16_t vid, uint16_t pid, const char *serial_number,
+		uint64_t *reenum_usec)
+{
+	libusb_hotplug_callback_handle hotplug;
+	bool use_hotplug = false;
+	int arrived = false;
+	char serial_str[256];
+	struct timespec start, now;
+	ssize_t len;
+	int err;
+
+	// Setting the configuration always causes a re-enumeration, so skip it
+	// if nothing changes
+	struct u3loop_config cur_config;
+	len = libusb_control_transfer(dev,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 0,
+			U3LOOP_CMD_GET_CONFIG, 0,
+			(unsigned char *) &cur_config, sizeof(cur_config),
+			USB_TIMEOUT);
+	if (len == sizeof(cur_config) &&
+	    memcmp(&cur_config, config, sizeof(cur_config)) == 0)
+	{
+		if (verbose) {
+			printf("Device already configured\n");
+		}
+		return dev;
+	}
+
+	// Remember which device this is; the bus address changes after
+	// re-enumeration, and the old device might still be listed for a while.
+	libusb_device *udev = libusb_get_device(dev);
+	uint8_t old_bus = libusb_get_bus_number(udev);
+	uint8_t old_addr = libusb_get_device_address(udev);
+	if (serial_number == NULL) {
+		struct libusb_device_descriptor desc;
+		err = libusb_get_device_descriptor(udev, &desc);
+		if (err == LIBUSB_SUCCESS) {
+			err = libusb_get_string_descriptor_ascii(dev,
+					desc.iSerialNumber,
+					(unsigned char *) serial_str,
+					sizeof(serial_str));
+		}
+		if (err > 0) {
+			serial_number = serial_str;
+		}
+	}
+
+	// Register before configuring, to not miss the arrival
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		err = libusb_hotplug_register_callback(NULL,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+				LIBUSB_HOTPLUG_NO_FLAGS, vid, pid,
+				LIBUSB_HOTPLUG_MATCH_ANY, arrived_cb, &arrived,
+				&hotplug);
+		use_hotplug = (err == LIBUSB_SUCCESS);
+	}
+
+	len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
+			U3LOOP_CMD_SET_CONFIG, 0,
+			(unsigned char *) config, sizeof(*config),
+			USB_TIMEOUT);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	libusb_release_interface(dev, IFNUM);
+	libusb_close(dev);
+	dev = NULL;
+	if (len < LIBUSB_SUCCESS) {
+		fprintf(stderr, "Failed to configure device for test: %s\n",
+				libusb_error_name(len));
+		goto done;
+	}
+
+	if (verbose) {
+		printf("Waiting for device to re-enumrate%s\n",
+				use_hotplug ? "" : " (polling)");
+	}
+
+	do {
+		// Once arrived, handling events returns immediately, so poll
+		// the device list at the same rate as without hotplug
+		if (use_hotplug && !arrived) {
+			struct timeval tv = { 0, REENUM_POLL_MS * 1000 };
+			libusb_handle_events_timeout_completed(NULL, &tv, &arrived);
+		} else {
+			struct timespec ts = { 0, REENUM_POLL_MS * 1000000 };
+			nanosleep(&ts, NULL);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		// Keep trying after an arrival, opening might fail until
+		// udev has set the permissions
+		if (!use_hotplug || arrived) {
+			dev = u3dev_open(NULL, vid, pid, serial_number);
+			if (dev != NULL &&
+			    libusb_get_bus_number(libusb_get_device(dev)) == old_bus &&
+			    libusb_get_device_address(libusb_get_device(dev)) == old_addr)
+			{
+				// Device didn't disconnect yet
+				libusb_release_interface(dev, IFNUM);
+				libusb_close(dev);
+				dev = NULL;
+			}
+		}
+	} while (dev == NULL && !u3dev_stop &&
+		 elapsed_usec(&start, &now) < MAX_DEVICE_WAIT * 1000000ull);
+
+	if (dev == NULL) {
+		fprintf(stderr, "Timeout waiting for device to re-enumerate\n");
+	} else if (reenum_usec != NULL) {
+		*reenum_usec = elapsed_usec(&start, &now);
+	}
+
+done:
+	if (use_hotplug) {
+		libusb_hotplug_deregister_callback(NULL, hotplug);
+	}
+	return dev;
+}
+
+int u3dev_link_speed(struct libusb_device_handle *dev)
+{
+	switch (libusb_get_device_speed(libusb_get_device(dev))) {
+	case LIBUSB_SPEED_LOW:
+	case LIBUSB_SPEED_FULL:
+		return U3LOOP_SPEED_FULL;
+	case LIBUSB_SPEED_HIGH:
+		return U3LOOP_SPEED_HIGH;
+	case LIBUSB_SPEED_SUPER:
+#if LIBUSB_API_VERSION >= 0x01000106
+	case LIBUSB_SPEED_SUPER_PLUS:
+#endif // LIBUSB_API_VERSION >= 0x01000106
+		return U3LOOP_SPEED_SUPER;
+	default:
+		return 0;
+	}
+}
+
+const char *u3dev_speed_name(int speed)
+{
+	switch (speed) {
+	case U3LOOP_SPEED_FULL:
+		return "fs";
+	case U3LOOP_SPEED_HIGH:
+		return "hs";
+	case U3LOOP_SPEED_SUPER:
+		return "ss";
+	default:
+		return "unknown";
+	}
+}
+
+void u3dev_probe(struct libusb_device_handle *dev, struct u3dev_caps *caps)
+{
+	struct libusb_device_descriptor desc;
+	struct u3loop_config config;
+	uint8_t max_speed;
+	ssize_t len;
+
+	memset(caps, 0, sizeof(*caps));
+
+	if (libusb_get_device_descriptor(libusb_get_device(dev), &desc) ==
+			LIBUSB_SUCCESS)
+	{
+		caps->firmware = desc.bcdDevice;
+	}
+	caps->link_speed = u3dev_link_speed(dev);
+
+	len = libusb_control_transfer(dev,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 0,
+			U3LOOP_CMD_GET_MAX_SPEED, 0,
+			&max_speed, sizeof(max_speed), USB_TIMEOUT);
+	if (len == sizeof(max_speed)) {
+		caps->max_speed = max_speed;
+	}
+
+	len = libusb_control_transfer(dev,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 0,
+			U3LOOP_CMD_GET_CONFIG, 0,
+			(unsigned char *) &config, sizeof(config), USB_TIMEOUT);
+	if (len == sizeof(config)) {
+		caps->config_speed = config.speed;
+	}
+
+	len = libusb_control_transfer(dev,
+			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 0,
+			U3LOOP_CMD_GET_DEVICE_INFO, 0,
+			caps->info, sizeof(caps->info), USB_TIMEOUT);
+	if (len > 0) {
+		caps->info_len = len;
+	}
+}
+
+int u3dev_select_speed(const struct u3dev_caps *caps)
+{
+	int speed = U3LOOP_SPEED_SUPER;
+
+	if (caps->max_speed >= U3LOOP_SPEED_FULL &&
+	    caps->max_speed < U3LOOP_SPEED_SUPER)
+	{
+		speed = caps->max_speed;
+	}
+	if (caps->link_speed != 0 && caps->link_speed < caps->config_speed &&
+	    caps->link_speed < speed)
+	{
+		speed = caps->link_speed;
+	}
+
+	return speed;
+}
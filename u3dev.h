@@ -0,0 +1,107 @@
+/**
+ * u3dev.h - PassMark device setup, shared by u3loop and u3bench
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __U3DEV_H__
+#define __U3DEV_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <libusb.h>
+
+#include "u3loop_defines.h"
+
+// Defined by the tool; enables progress messages
+extern unsigned int verbose;
+
+// Set, e.g. from a signal handler, to stop waiting for re-enumeration
+extern volatile sig_atomic_t u3dev_stop;
+
+// What a PassMark device and its port support
+struct u3dev_caps {
+	int max_speed;		// Reported by device, 0 if unknown
+	int link_speed;		// Current link speed, 0 if unknown
+	int config_speed;	// Currently configured speed, 0 if unknown
+	uint16_t firmware;	// bcdDevice
+	uint8_t info[U3LOOP_DEVICE_INFO_MAX]; // Format unknown
+	int info_len;
+};
+
+uint64_t elapsed_usec(const struct timespec *from, const struct timespec *to);
+
+/**
+ * Open a device and claim its interface
+ *
+ * @param dev_path	Bus and device number as "BBB.DDD", or NULL to find the
+ *			device by vendor and product ID
+ * @param serial_number	Serial number to match, or NULL for the first device
+ * @returns device handle, or NULL if not found
+ */
+struct libusb_device_handle *u3dev_open(const char *dev_path,
+		uint16_t vid, uint16_t pid, const char *serial_number);
+
+/**
+ * Send test configuration to a PassMark device and reopen it
+ *
+ * If the device already has this configuration dev is returned as is.
+ * Otherwise the device re-enumerates after being configured, so dev is closed
+ * and the device is searched for again by serial number. If hotplug is
+ * supported the device list is only searched after a device arrived, else
+ * it is polled.
+ *
+ * @param reenum_usec	If not NULL, returns time it took to re-enumerate;
+ *			untouched if the device was already configured
+ * @returns handle of the re-enumerated device, or NULL on error
+ */
+struct libusb_device_handle *u3dev_configure(struct libusb_device_handle *dev,
+		const struct u3loop_config *config,
+		uint16_t vid, uint16_t pid, const char *serial_number,
+		uint64_t *reenum_usec);
+
+/**
+ * USB speed of the link to a device
+ *
+ * @returns U3LOOP_SPEED_* value, or 0 if unknown
+ */
+int u3dev_link_speed(struct libusb_device_handle *dev);
+const char *u3dev_speed_name(int speed);
+
+/**
+ * Query what a PassMark device, and the port it is connected to, support
+ *
+ * Requests the device doesn't support, e.g. on older firmware, leave the
+ * corresponding fields 0.
+ */
+void u3dev_probe(struct libusb_device_handle *dev, struct u3dev_caps *caps);
+
+/**
+ * Fastest speed supported by both a device and its port
+ *
+ * The link speed only shows the limit of the port if it is below the speed
+ * the device is configured for. Otherwise the port might be faster, which is
+ * only known after configuring the device.
+ */
+int u3dev_select_speed(const struct u3dev_caps *caps);
+
+#endif // __U3DEV_H__
@@ -38,6 +38,9 @@
 #include <math.h>
 
 #include "u3loop_defines.h"
+#include "u3verify.h"
+#include "prbs.h"
+#include "u3dev.h"
 
 #define VERSION "v0.0.0-20200321"
 
@@ -50,10 +53,12 @@
 #define ALTIFNUM 1
 
 #define USB_TIMEOUT 2000	//2000 millisecs == 2 seconds 
-#define MAX_DEVICE_WAIT 10	// Time in seconds to wait for re-enumration
 
 #define DEFAULT_DISPLAY_IVAL 1
 
+#define BLOCK_SIZE  0x10000 // TODO: make variable. Depends on link speed???
+
+
 sig_atomic_t running = true;
 sig_atomic_t timer_triggered = false;
 
@@ -104,11 +109,36 @@ struct state_t {
 	struct timespec measurement_time;
 	// Counters at last measurement
 	struct stat_counters measurement;
+
+	//***** Written by transfer callbacks *****//
+	// # of transfers submitted to libusb
+	unsigned int active_transfers;
+	// Set on fatal transfer errors
+	bool failed;
+
+	// Sequence stamped data verification
+	struct u3verify_tx verify_tx;
+	struct u3verify_rx verify_rx;
+
+	// PRBS data generation and checking, replaces sequence stamps
+	enum prbs_type prbs;
+	struct prbs_gen prbs_tx;
+	struct prbs_stats prbs_rx;
+};
+
+// A block in the loopback pipeline: sent by OUT and received back by IN
+struct loop_slot {
+	struct state_t *state;
+	struct libusb_transfer *out;
+	struct libusb_transfer *in;
+	bool out_done;
+	bool in_done;
 };
 
 
 void terminator(__attribute__((unused)) int signum) {
 	running = false;
+	u3dev_stop = true;
 }
 
 void timer_cb(__attribute__((unused)) int signum)
@@ -119,17 +149,22 @@ void timer_cb(__attribute__((unused)) int signum)
 void usage(const char *name)
 {
 	fprintf(stderr, "Utility for USB 3.0 loopback plug - %s\n", VERSION);
-	fprintf(stderr, "Usage: %s [-bvh] [-c CNT] [-i SEC] [-s SERIAL] [-S SPEED] [-t SEC]\n", name);
+	fprintf(stderr, "Usage: %s [-bvh] [-c CNT] [-i SEC] [-P PRBS] [-s SERIAL] [-S SPEED]\n"
+			"       [-t SEC] [-w BLOCKS]\n", name);
 	fprintf(stderr, "\nOptions:\n");
 	fprintf(stderr, " -b        Identify device by blinking LED's and exiting\n");
 	fprintf(stderr, " -c CNT    Report statistics every CNT operations\n");
 	fprintf(stderr, " -i SEC    Report statistics every SEC seconds\n");
+	fprintf(stderr, " -P PRBS   Send PRBS data instead of sequence stamped blocks and report\n");
+	fprintf(stderr, "           bit error rate. PRBS = prbs7, prbs15, prbs23 or prbs31\n");
 	fprintf(stderr, " -s SERIAL Use device with this serial number\n");
 	fprintf(stderr, " -S SPEED  Force device to work at USB speed\n");
-	fprintf(stderr, "             fs = USB 1.x Full Speed, 12 Mbit/s\n");
-	fprintf(stderr, "             hs = USB 2.0 High Speed, 480 Mbit/s\n");
-	fprintf(stderr, "             ss = USB 3.x Super Speed, 5 Gbit/s\n");
+	fprintf(stderr, "             auto = Fastest supported by device and port (Default)\n");
+	fprintf(stderr, "             fs   = USB 1.x Full Speed, 12 Mbit/s\n");
+	fprintf(stderr, "             hs   = USB 2.0 High Speed, 480 Mbit/s\n");
+	fprintf(stderr, "             ss   = USB 3.x Super Speed, 5 Gbit/s\n");
 	fprintf(stderr, " -t SEC    Time limit of test in seconds (0=forever)\n");
+	fprintf(stderr, " -w BLOCKS Blocks to keep in flight (default: based on device buffer size)\n");
 	fprintf(stderr, " -v        Increase verbosity level. Can be used multiple times\n");
 	fprintf(stderr, " -h        This help message\n");
 }
@@ -291,6 +326,18 @@ void print_report(struct state_t *s)
 	printf(" - rx_timeout:   %u\n", s->cum_host_errors.rx_timeout);
 	printf(" - rx_overflow:  %u\n", s->cum_host_errors.rx_overflow);
 	printf("\n");
+	if (s->prbs != PRBS_NONE) {
+		prbs_print_report(s->prbs, &s->prbs_rx);
+	} else {
+		printf("Verified blocks:\n");
+		printf(" - ok:           %lu\n", s->verify_rx.stats.ok);
+		printf(" - corrupt:      %lu\n", s->verify_rx.stats.corrupt);
+		printf(" - lost:         %lu\n", s->verify_rx.stats.lost);
+		printf(" - duplicate:    %lu\n", s->verify_rx.stats.duplicate);
+		printf(" - out of order: %lu\n", s->verify_rx.stats.out_of_order);
+		printf(" - late:         %lu\n", s->verify_rx.stats.late);
+	}
+	printf("\n");
 	printf("Device Errors:\n");
 	printf(" - Physical layer errors: %u\n", s->cum_dev_errors.phy_error_cnt);
 	print_dev_phy_errors(&(s->cum_dev_errors));
@@ -298,85 +345,135 @@ void print_report(struct state_t *s)
 	print_dev_ll_errors(&(s->cum_dev_errors));
 }
 
-struct libusb_device_handle * open_device(char *serial_number)
+/**
+ * Resubmit both transfers of a slot, OUT first
+ */
+void slot_submit(struct loop_slot *slot)
 {
-	struct libusb_device_handle *dev;
-	libusb_device **devs;
-	ssize_t cnt;
-	int i;
+	struct state_t *state = slot->state;
 	int err;
 
-	cnt = libusb_get_device_list(NULL, &devs);
-	if (cnt < 0) {
-		fprintf(stderr, "Failed to get USB device list: %s\n",
-				libusb_error_name(cnt));
-		return NULL;
+	slot->out_done = false;
+	slot->in_done = false;
+
+	if (state->prbs != PRBS_NONE) {
+		prbs_fill(&state->prbs_tx, slot->out->buffer, slot->out->length);
+	} else {
+		u3verify_fill(&state->verify_tx, slot->out->buffer, slot->out->length);
 	}
 
-	bool found = false;
-	for (i=0; i < cnt && !found; i++) {
-		struct libusb_device_descriptor desc;
-		err = libusb_get_device_descriptor(devs[i], &desc);
-		if (err != LIBUSB_SUCCESS) {
-			continue;
-		}
+	err = libusb_submit_transfer(slot->out);
+	if (err != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Failed to submit transfer: %s\n", libusb_strerror(err));
+		state->failed = true;
+		running = false;
+		return;
+	}
+	state->active_transfers++;
+
+	err = libusb_submit_transfer(slot->in);
+	if (err != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Failed to submit transfer: %s\n", libusb_strerror(err));
+		state->failed = true;
+		running = false;
+		return;
+	}
+	state->active_transfers++;
+}
 
-		if (desc.idVendor != VID ||
-		    desc.idProduct != PID)
+/**
+ * Called when both the OUT and IN transfer of a slot are done
+ *
+ * Slots complete in the order they were submitted, because transfers on an
+ * endpoint complete in order. So the received block normally belongs to the
+ * block sent from the same slot. The sequence stamp in the block is used to
+ * detect when that is not the case.
+ */
+void slot_complete(struct loop_slot *slot)
+{
+	struct state_t *state = slot->state;
+
+	if (state->prbs != PRBS_NONE) {
+		uint64_t syndrome = state->prbs_rx.syndrome;
+		prbs_check(state->prbs, slot->in->buffer,
+				slot->in->actual_length, &state->prbs_rx);
+		if (slot->in->actual_length != slot->out->length ||
+		    state->prbs_rx.syndrome != syndrome)
 		{
-			continue;
+			state->host_errors.data_corrupt++;
 		}
+	} else if (u3verify_check(&state->verify_rx, slot->in->buffer,
+			slot->in->actual_length) == U3VERIFY_CORRUPT)
+	{
+		state->host_errors.data_corrupt++;
+	}
 
-		err = libusb_open(devs[i], &dev);
-		if (err != LIBUSB_SUCCESS) {
-			if (verbose) {
-				fprintf(stderr, "Unable to open device: %s\n", libusb_error_name(err));
-			}
-			continue;
-		}
+	// Count operations
+	state->ops++;
 
-		char serial_str[256];
-		err = libusb_get_string_descriptor_ascii(dev,
-					desc.iSerialNumber,
-					(unsigned char *)serial_str,
-					sizeof(serial_str));
-		if (err == LIBUSB_SUCCESS) {
-			if (verbose) {
-				fprintf(stderr, "Unable to get serial number: %s\n", libusb_error_name(err));
-			}
-			libusb_close(dev);
-			continue;
-		}
+	if (running) {
+		slot_submit(slot);
+	}
+}
 
-		if (serial_number == NULL ||
-				strcmp(serial_str, serial_number) == 0)
-		{
-			found = true;
-			if (verbose) {
-				printf("Found Device @ bus: %u, device: %u, s/n: %s\n",
-						       libusb_get_bus_number(devs[i]),
-						       libusb_get_device_address(devs[i]),
-						       serial_str);
-			}
+void transfer_cb(struct libusb_transfer *transfer)
+{
+	struct loop_slot *slot = (struct loop_slot *) transfer->user_data;
+	struct state_t *state = slot->state;
+	bool is_tx = (transfer == slot->out);
+
+	state->active_transfers--;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		if (is_tx) {
+			state->host_errors.tx_timeout++;
+		} else {
+			state->host_errors.rx_timeout++;
+		}
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		if (is_tx) {
+			state->host_errors.tx_stall++;
 		} else {
-			libusb_close(dev);
+			state->host_errors.rx_stall++;
 		}
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		if (is_tx) {
+			state->host_errors.tx_overflow++;
+		} else {
+			state->host_errors.rx_overflow++;
+		}
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return; // Stop on cancellation of transfer
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		fprintf(stderr, "Device disconnected\n");
+		state->failed = true;
+		running = false;
+		return;
+	default:
+		fprintf(stderr, "Failed to %s device\n",
+				is_tx ? "send data to" : "receive data from");
+		state->failed = true;
+		running = false;
+		return;
 	}
-	libusb_free_device_list(devs, 1);
 
-	if (!found) {
-		return NULL;
+	if (is_tx) {
+		state->ctrs.tx_bytes += transfer->actual_length;
+		slot->out_done = true;
+	} else {
+		state->ctrs.rx_bytes += transfer->actual_length;
+		slot->in_done = true;
 	}
 
-	err = libusb_claim_interface(dev, IFNUM);
-	if (err != LIBUSB_SUCCESS) {
-		fprintf(stderr, "Failed to claim device interface: %s\n",
-				libusb_error_name(err));
-		libusb_close(dev);
-		return NULL;
+	if (slot->out_done && slot->in_done) {
+		slot_complete(slot);
 	}
-
-	return dev;
 }
 
 int main(int argc, char *argv[])
@@ -390,14 +487,17 @@ int main(int argc, char *argv[])
 	time_t opt_time_limit;
 	int opt_report_ival = -1;
 	long long opt_report_ops = -1;
-	int opt_speed = U3LOOP_SPEED_SUPER;
+	int opt_speed = 0;
+	int opt_window = 0;
+	enum prbs_type opt_prbs = PRBS_NONE;
+	struct loop_slot *slots = NULL;
 	int retval = EXIT_FAILURE;
 	int err;
 	ssize_t len;
 	int i;
 	struct state_t state = { 0 };
 
-	while ((opt = getopt(argc, argv, "bc:i:s:S:t:vh")) != -1) {
+	while ((opt = getopt(argc, argv, "bc:i:P:s:S:t:w:vh")) != -1) {
 		switch (opt) {
 		case 'b':
 			opt_identify = true;
@@ -416,11 +516,20 @@ int main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'P':
+			opt_prbs = prbs_parse(optarg);
+			if (opt_prbs == PRBS_NONE) {
+				fprintf(stderr, "Invalid argument for '-P' option\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 's':
 			opt_serial_number = optarg;
 			break;
 		case 'S':
-			if (strcasecmp(optarg, "fs") == 0) {
+			if (strcasecmp(optarg, "auto") == 0) {
+				opt_speed = 0;
+			} else if (strcasecmp(optarg, "fs") == 0) {
 				opt_speed = U3LOOP_SPEED_FULL;
 			} else if (strcasecmp(optarg, "hs") == 0) {
 				opt_speed = U3LOOP_SPEED_HIGH;
@@ -438,6 +547,13 @@ int main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'w':
+			opt_window = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || opt_window <= 0) {
+				fprintf(stderr, "Argument to '-w' must be a positive number\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -482,7 +598,7 @@ int main(int argc, char *argv[])
 
 
 	// Find device and open it
-	dev = open_device(opt_serial_number);
+	dev = u3dev_open(NULL, VID, PID, opt_serial_number);
 	if (dev == NULL) {
 		fprintf(stderr, "Unable to find usable loopback plug\n");
 		goto fail1;
@@ -535,6 +651,12 @@ int main(int argc, char *argv[])
 	}
 
 	// Configure device
+	int speed = opt_speed;
+	if (speed == 0) {
+		struct u3dev_caps caps;
+		u3dev_probe(dev, &caps);
+		speed = u3dev_select_speed(&caps);
+	}
 	struct u3loop_config dev_config = {
 		.mode = U3LOOP_MODE_LOOPBACK,
 		.ep_type = U3LOOP_EP_TYPE_BULK,
@@ -545,39 +667,50 @@ int main(int argc, char *argv[])
 		.hs_bulk_nak_interval = 0x00,
 		.iso_transactions_per_bus_interval = 0x03,
 		.iso_bytes_per_bus_interval = htole16(0xC000),
-		.speed = opt_speed,
+		.speed = speed,
 		.buffer_count = 0x40,
 		.buffer_size = htole16(0x0400)
 	};
-	len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
-			U3LOOP_CMD_SET_CONFIG, 0,
-			(unsigned char *) &dev_config, sizeof(dev_config),
-			USB_TIMEOUT);
-	if (len < LIBUSB_SUCCESS) {
-		fprintf(stderr, "Failed to configure device for test: %s\n",
-				libusb_error_name(len));
-		goto fail2;
-	}
-	libusb_release_interface(dev, IFNUM);
-	libusb_close(dev);
-	dev = NULL;
 
-	if (verbose) {
-		printf("Waiting for device to re-enumrate\n");
+	// Keep enough blocks in flight to fill the device's buffers, plus one
+	// block in transit.
+	if (opt_window == 0) {
+		size_t dev_buf_size = dev_config.buffer_count *
+				le16toh(dev_config.buffer_size);
+		opt_window = (dev_buf_size + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
 	}
-
-	for (i=0; dev == NULL && i < MAX_DEVICE_WAIT; i++) {
-		sleep(1);
-		// FIXME: if multiple adapters are connected; and no
-		// opt_serial_number is specified this breaks!!! get serial of
-		// previously opened device...
-		dev = open_device(opt_serial_number);
+	if (verbose) {
+		printf("Using window of %d blocks of %d bytes\n",
+				opt_window, BLOCK_SIZE);
 	}
 
+	uint64_t reenum_usec = 0;
+	dev = u3dev_configure(dev, &dev_config, VID, PID, opt_serial_number,
+			&reenum_usec);
 	if (dev == NULL) {
-		fprintf(stderr, "Timeout waiting for device to re-enumerate\n");
 		goto fail1;
 	}
+	if (reenum_usec != 0) {
+		printf("Device re-enumerated in %.3f Sec.\n", reenum_usec / 1000000.0);
+	}
+
+	// The port turned out to be slower than the device
+	int link = u3dev_link_speed(dev);
+	if (opt_speed == 0 && link != 0 && link < dev_config.speed) {
+		dev_config.speed = link;
+		reenum_usec = 0;
+		dev = u3dev_configure(dev, &dev_config, VID, PID,
+				opt_serial_number, &reenum_usec);
+		if (dev == NULL) {
+			goto fail1;
+		}
+		if (reenum_usec != 0) {
+			printf("Device re-enumerated in %.3f Sec.\n", reenum_usec / 1000000.0);
+		}
+	}
+	printf("Speed: %s (%s, link: %s)\n", u3dev_speed_name(dev_config.speed),
+			opt_speed == 0 ? "auto" : "forced",
+			u3dev_speed_name(u3dev_link_speed(dev)));
 
 	// Disable Link Power Management
 	len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR, 0,
@@ -633,77 +766,75 @@ int main(int argc, char *argv[])
 		goto fail2;
 	}
 
+	// Setup transfer pipeline
+	slots = calloc(opt_window, sizeof(*slots));
+	if (slots == NULL) {
+		perror("calloc()");
+		goto fail3;
+	}
+	for (i=0; i < opt_window; i++) {
+		slots[i].state = &state;
+		slots[i].out = libusb_alloc_transfer(0);
+		slots[i].in = libusb_alloc_transfer(0);
+		if (slots[i].out == NULL || slots[i].in == NULL) {
+			fprintf(stderr, "Failed to allocate transfer\n");
+			goto fail4;
+		}
+
+		uint8_t *txbuf = malloc(BLOCK_SIZE);
+		uint8_t *rxbuf = malloc(BLOCK_SIZE);
+		if (txbuf == NULL || rxbuf == NULL) {
+			perror("malloc()");
+			free(txbuf);
+			free(rxbuf);
+			goto fail4;
+		}
+
+		libusb_fill_bulk_transfer(slots[i].out, dev, BULK_OUT, txbuf,
+				BLOCK_SIZE, transfer_cb, &slots[i], USB_TIMEOUT);
+		libusb_fill_bulk_transfer(slots[i].in, dev, BULK_IN, rxbuf,
+				BLOCK_SIZE, transfer_cb, &slots[i], USB_TIMEOUT);
+	}
+
 	// Get start time
 	if (clock_gettime(CLOCK_MONOTONIC, &(state.start_time)) == -1) {
 		perror("clock_gettime");
-		goto fail3;
+		goto fail4;
 	}
 	state.measurement_time = state.start_time;
 
 	// Run test
-	size_t transfered;
-
-#define BLOCK_SIZE  0x10000 // TODO: make variable. Depends on link speed???
-	uint8_t txbuf[BLOCK_SIZE];
-	uint8_t rxbuf[BLOCK_SIZE];
-	memset(txbuf, 0xC5, BLOCK_SIZE);
+	uint32_t run_id = u3verify_run_id();
+	u3verify_tx_init(&state.verify_tx, run_id);
+	u3verify_rx_init(&state.verify_rx, run_id);
+	state.prbs = opt_prbs;
+	prbs_init(&state.prbs_tx, opt_prbs);
+	if (opt_prbs != PRBS_NONE && verbose) {
+		printf("Using %s PRBS implementation\n", prbs_impl_name());
+	}
+	for (i=0; i < opt_window && running; i++) {
+		slot_submit(&slots[i]);
+	}
 
-	unsigned long long ops_since_last_measurement = 0;
+	unsigned long long ops_at_last_measurement = 0;
 	bool take_measurement = false;
+	struct timeval tick = { 0, 100000 };
 
 	printf("Time, Ops, Speed(mbps), Avg. Speed(mbps), Host Error count, Phy. Error Count, Phy Error Mask, Link Error Count, Link Error Mask\n");
 	while (true) {
-		// TX Data
-		transfered = 0;
-		err = libusb_bulk_transfer(dev, BULK_OUT,
-				txbuf, BLOCK_SIZE, (int *) &transfered,
-				USB_TIMEOUT);
-		if (err != LIBUSB_SUCCESS) {
-			if (err == LIBUSB_ERROR_TIMEOUT) {
-				state.host_errors.tx_timeout++;
-			} else if (err == LIBUSB_ERROR_PIPE) {
-				state.host_errors.tx_stall++;
-			} else if (err == LIBUSB_ERROR_OVERFLOW) {
-				state.host_errors.tx_overflow++;
-			} else {
-				fprintf(stderr, "Failed to send data to device: %s\n",
-						libusb_error_name(err));
-				goto fail3;
-			}
-		}
-		state.ctrs.tx_bytes += transfered;
-
-		// RX Data
-		transfered = 0;
-		err = libusb_bulk_transfer(dev, BULK_IN,
-				rxbuf, BLOCK_SIZE, (int *) &transfered,
-				USB_TIMEOUT);
-		if (err != LIBUSB_SUCCESS) {
-			if (err == LIBUSB_ERROR_TIMEOUT) {
-				state.host_errors.rx_timeout++;
-			} else if (err == LIBUSB_ERROR_PIPE) {
-				state.host_errors.rx_stall++;
-			} else if (err == LIBUSB_ERROR_OVERFLOW) {
-				state.host_errors.rx_overflow++;
-			} else {
-				fprintf(stderr, "Failed to receive data from device: "
-						"%s\n", libusb_error_name(err));
-				goto fail3;
-			}
-		}
-		state.ctrs.rx_bytes += transfered;
+		// Process completions, also returns when timer signal arrives
+		libusb_handle_events_timeout_completed(NULL, &tick, NULL);
 
-		if (memcmp(txbuf, rxbuf, BLOCK_SIZE) != 0) {
-			state.host_errors.data_corrupt++;
+		if (state.failed) {
+			goto fail4;
 		}
 
 		// Count operations
-		state.ops++;
 		if (opt_report_ops > 0 &&
-		    ++ops_since_last_measurement >= (unsigned long long) opt_report_ops)
+		    state.ops - ops_at_last_measurement >= (unsigned long long) opt_report_ops)
 		{
 			take_measurement = true;
-			ops_since_last_measurement = 0;
+			ops_at_last_measurement = state.ops;
 		}
 
 		// Service periodic things, every second
@@ -713,7 +844,7 @@ int main(int argc, char *argv[])
 			struct timespec now;
 			if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
 				perror("clock_gettime");
-				goto fail3;
+				goto fail4;
 			}
 			time_t time_running =  now.tv_sec - state.start_time.tv_sec;
 
@@ -771,10 +902,37 @@ int main(int argc, char *argv[])
 	};
 
 	// Cumulative error report
+	if (state.prbs == PRBS_NONE) {
+		u3verify_rx_finish(&state.verify_rx);
+	}
 	print_report(&state);
 
 	retval = EXIT_SUCCESS;
 
+fail4:
+	// Cancel all submitted transfers
+	running = false;
+	for (i=0; slots != NULL && i < opt_window; i++) {
+		if (slots[i].out != NULL) libusb_cancel_transfer(slots[i].out);
+		if (slots[i].in != NULL) libusb_cancel_transfer(slots[i].in);
+	}
+	// TODO: add timeout
+	while (state.active_transfers != 0) {
+		libusb_handle_events(NULL);
+	}
+
+	// Free transfers
+	for (i=0; slots != NULL && i < opt_window; i++) {
+		if (slots[i].out != NULL) {
+			free(slots[i].out->buffer);
+			libusb_free_transfer(slots[i].out);
+		}
+		if (slots[i].in != NULL) {
+			free(slots[i].in->buffer);
+			libusb_free_transfer(slots[i].in);
+		}
+	}
+	free(slots);
 fail3:
 	if (timer_delete(timer) == -1) {
 		perror("timer_delete");
@@ -123,6 +123,31 @@ struct u3loop_errors {
 };
 #pragma pack()
 
+/**
+ * U3LOOP_CMD_GET_MAX_SPEED data
+ *
+ * One byte, U3LOOP_SPEED_* value.
+ * NOTE: format is a guess, not verified against the PassMark software
+ */
+
+/**
+ * U3LOOP_CMD_GET_DEVICE_INFO data
+ *
+ * NOTE: format is unknown
+ */
+#define U3LOOP_DEVICE_INFO_MAX 64 // Max. size of data
+
+/**
+ * U3LOOP_CMD_GET_VOLTAGE data
+ *
+ * NOTE: format is a guess, not verified against the PassMark software
+ */
+#pragma pack(1)
+struct u3loop_voltage {
+	uint16_t vbus; // VBUS voltage in mV
+};
+#pragma pack()
+
 // See also FAQ:
 // https://www.passmark.com/support/usb3loopback_faq.php
 // "The red Error LED goes on. What does this mean?"
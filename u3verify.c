@@ -0,0 +1,224 @@
+/**
+ * u3verify.c - Sequence stamped data blocks for loopback verification
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <endian.h>
+
+#include "u3verify.h"
+
+/**
+ * Initial payload generator state for a block
+ */
+static uint64_t payload_seed(uint32_t run_id, uint64_t seq)
+{
+	// splitmix64 finalizer; xorshift gets stuck on 0, so avoid that seed
+	uint64_t z = ((uint64_t) run_id << 32) ^ seq;
+	z += 0x9e3779b97f4a7c15ull;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	z ^= z >> 31;
+	return z ? z : 1;
+}
+
+/**
+ * xorshift64 step; cheap enough to keep up with SuperSpeed on a single core
+ */
+static inline uint64_t payload_next(uint64_t *s)
+{
+	uint64_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*s = x;
+	return x;
+}
+
+uint32_t u3verify_run_id(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint32_t) payload_seed(getpid(), now.tv_sec * 1000000000ull + now.tv_nsec);
+}
+
+void u3verify_tx_init(struct u3verify_tx *tx, uint32_t run_id)
+{
+	memset(tx, 0, sizeof(*tx));
+	tx->run_id = run_id;
+}
+
+void u3verify_rx_init(struct u3verify_rx *rx, uint32_t run_id)
+{
+	memset(rx, 0, sizeof(*rx));
+	rx->run_id = run_id;
+	// Pretend all blocks before sequence number 0 were received
+	rx->window = ~0ull;
+}
+
+void u3verify_fill(struct u3verify_tx *tx, uint8_t *buf, size_t len)
+{
+	struct u3verify_header hdr = {
+		.magic = htole32(U3VERIFY_MAGIC),
+		.run_id = htole32(tx->run_id),
+		.seq = htole64(tx->seq),
+		.offset = htole64(tx->offset),
+		.length = htole32(len),
+		.reserved = 0
+	};
+
+	if (len < sizeof(hdr)) {
+		memcpy(buf, &hdr, len);
+	} else {
+		memcpy(buf, &hdr, sizeof(hdr));
+
+		uint64_t s = payload_seed(tx->run_id, tx->seq);
+		size_t i;
+		for (i = sizeof(hdr); i + 8 <= len; i += 8) {
+			uint64_t v = htole64(payload_next(&s));
+			memcpy(&buf[i], &v, 8);
+		}
+		if (i < len) {
+			uint64_t v = htole64(payload_next(&s));
+			memcpy(&buf[i], &v, len - i);
+		}
+	}
+
+	tx->seq++;
+	tx->offset += len;
+}
+
+/**
+ * Register sequence number as received
+ *
+ * @returns classification of the block based on its sequence number
+ */
+static enum u3verify_result track_seq(struct u3verify_rx *rx, uint64_t seq)
+{
+	if (seq >= rx->next_seq) {
+		uint64_t shift = seq - rx->next_seq + 1;
+		if (shift >= U3VERIFY_WINDOW) {
+			// Window moves beyond all blocks in it, and the gap
+			// before the new block
+			rx->stats.lost += U3VERIFY_WINDOW - __builtin_popcountll(rx->window);
+			rx->stats.lost += shift - U3VERIFY_WINDOW;
+			rx->window = 0;
+		} else {
+			uint64_t leaving = rx->window >> (U3VERIFY_WINDOW - shift);
+			rx->stats.lost += shift - __builtin_popcountll(leaving);
+			rx->window <<= shift;
+		}
+		rx->window |= 1;
+		rx->next_seq = seq + 1;
+		return U3VERIFY_OK;
+	}
+
+	uint64_t n = rx->next_seq - 1 - seq;
+	if (n >= U3VERIFY_WINDOW) {
+		// Very late block; it might have been counted as lost, or be
+		// a stale duplicate, which can't be told apart any more
+		return U3VERIFY_LATE;
+	}
+	if (rx->window & (1ull << n)) {
+		return U3VERIFY_DUPLICATE;
+	}
+	rx->window |= (1ull << n);
+	return U3VERIFY_OUT_OF_ORDER;
+}
+
+void u3verify_rx_finish(struct u3verify_rx *rx)
+{
+	rx->stats.lost += U3VERIFY_WINDOW - __builtin_popcountll(rx->window);
+	rx->window = ~0ull;
+}
+
+enum u3verify_result u3verify_check(struct u3verify_rx *rx,
+		const uint8_t *buf, size_t len)
+{
+	struct u3verify_header hdr;
+	enum u3verify_result res;
+
+	if (len < sizeof(hdr)) {
+		rx->stats.corrupt++;
+		return U3VERIFY_CORRUPT;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	uint64_t seq = le64toh(hdr.seq);
+	if (le32toh(hdr.magic) != U3VERIFY_MAGIC ||
+	    le32toh(hdr.run_id) != rx->run_id ||
+	    le32toh(hdr.length) != len ||
+	    le64toh(hdr.offset) != seq * len)
+	{
+		// Header can't be trusted, so don't track sequence number
+		rx->stats.corrupt++;
+		return U3VERIFY_CORRUPT;
+	}
+
+	// Payload is checked a word at a time; stop at first mismatch
+	uint64_t s = payload_seed(rx->run_id, seq);
+	bool payload_ok = true;
+	size_t i;
+	for (i = sizeof(hdr); i + 8 <= len; i += 8) {
+		uint64_t v;
+		memcpy(&v, &buf[i], 8);
+		if (v != htole64(payload_next(&s))) {
+			payload_ok = false;
+			break;
+		}
+	}
+	if (payload_ok && i < len) {
+		uint64_t v = htole64(payload_next(&s));
+		payload_ok = (memcmp(&buf[i], &v, len - i) == 0);
+	}
+
+	res = track_seq(rx, seq);
+	if (!payload_ok) {
+		rx->stats.corrupt++;
+		return U3VERIFY_CORRUPT;
+	}
+
+	switch (res) {
+	case U3VERIFY_OK:
+		rx->stats.ok++;
+		break;
+	case U3VERIFY_DUPLICATE:
+		rx->stats.duplicate++;
+		break;
+	case U3VERIFY_OUT_OF_ORDER:
+		rx->stats.out_of_order++;
+		break;
+	case U3VERIFY_LATE:
+		rx->stats.late++;
+		break;
+	default:
+		break;
+	}
+
+	return res;
+}
@@ -0,0 +1,117 @@
+/**
+ * u3verify.h - Sequence stamped data blocks for loopback verification
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __U3VERIFY_H__
+#define __U3VERIFY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Block header
+ *
+ * Every block starts with this header, followed by a payload that is derived
+ * from the run ID and sequence number. All fields are Little-Endian.
+ */
+#pragma pack(1)
+struct u3verify_header {
+	uint32_t magic;
+#define U3VERIFY_MAGIC 0x56463355 // "U3FV"
+	uint32_t run_id; // Random ID of test run
+	uint64_t seq;    // Block sequence number, starts at 0
+	uint64_t offset; // Byte offset of block in stream
+	uint32_t length; // Block length, including header
+	uint32_t reserved;
+};
+#pragma pack()
+
+// Amount of blocks behind the newest received block before a missing block is
+// considered lost.
+#define U3VERIFY_WINDOW 64
+
+/**
+ * Block classification
+ */
+enum u3verify_result {
+	U3VERIFY_OK = 0,
+	U3VERIFY_CORRUPT,
+	U3VERIFY_DUPLICATE,
+	U3VERIFY_OUT_OF_ORDER,
+	U3VERIFY_LATE,	// Too old to tell if duplicate or out of order
+};
+
+struct u3verify_stats {
+	uint64_t ok;
+	uint64_t corrupt;
+	uint64_t lost;
+	uint64_t duplicate;
+	uint64_t out_of_order;
+	uint64_t late;		// Older than the window, also counted as lost
+};
+
+/**
+ * Sender state
+ */
+struct u3verify_tx {
+	uint32_t run_id;
+	uint64_t seq;
+	uint64_t offset;
+};
+
+/**
+ * Receiver state
+ */
+struct u3verify_rx {
+	uint32_t run_id;
+	uint64_t next_seq; // One past highest sequence number received
+	uint64_t window;   // Bit n is set if block (next_seq - 1 - n) was received
+	struct u3verify_stats stats;
+};
+
+/**
+ * Generate a run ID that is unlikely to match a previous run
+ */
+uint32_t u3verify_run_id(void);
+
+void u3verify_tx_init(struct u3verify_tx *tx, uint32_t run_id);
+void u3verify_rx_init(struct u3verify_rx *rx, uint32_t run_id);
+
+/**
+ * Fill buffer with the next block of the stream
+ *
+ * Buffers smaller than the header are filled with a truncated header.
+ */
+void u3verify_fill(struct u3verify_tx *tx, uint8_t *buf, size_t len);
+
+/**
+ * Verify a received block and update receiver statistics
+ */
+enum u3verify_result u3verify_check(struct u3verify_rx *rx,
+		const uint8_t *buf, size_t len);
+
+/**
+ * Count the blocks still missing in the window as lost, at end of test
+ */
+void u3verify_rx_finish(struct u3verify_rx *rx);
+
+#endif // __U3VERIFY_H__
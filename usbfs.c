@@ -0,0 +1,172 @@
+/**
+ * usbfs.c - Minimal asynchronous I/O on Linux usbfs, bypassing libusb
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _DEFAULT_SOURCE
+
+#include "usbfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+
+int usbfs_open(struct usbfs_dev *dev, uint8_t bus, uint8_t addr, int ifnum)
+{
+	char path[32];
+	int err;
+
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u", bus, addr);
+	dev->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (dev->fd == -1) {
+		return -errno;
+	}
+
+	unsigned int claim = ifnum;
+	if (ioctl(dev->fd, USBDEVFS_CLAIMINTERFACE, &claim) == -1) {
+		err = -errno;
+		goto fail1;
+	}
+	dev->ifnum = ifnum;
+
+	// usbfs signals completed URBs as writable
+	dev->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (dev->epfd == -1) {
+		err = -errno;
+		goto fail2;
+	}
+	struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = dev };
+	if (epoll_ctl(dev->epfd, EPOLL_CTL_ADD, dev->fd, &ev) == -1) {
+		err = -errno;
+		goto fail3;
+	}
+
+	return 0;
+
+fail3:
+	close(dev->epfd);
+fail2:
+	ioctl(dev->fd, USBDEVFS_RELEASEINTERFACE, &claim);
+fail1:
+	close(dev->fd);
+	dev->fd = -1;
+	return err;
+}
+
+void usbfs_close(struct usbfs_dev *dev)
+{
+	unsigned int claim = dev->ifnum;
+
+	close(dev->epfd);
+	ioctl(dev->fd, USBDEVFS_RELEASEINTERFACE, &claim);
+	close(dev->fd);
+	dev->fd = -1;
+}
+
+void *usbfs_alloc(struct usbfs_dev *dev, size_t len, int *zero_copy)
+{
+	void *buf;
+
+	// Supported since Linux 4.6
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+	if (buf != MAP_FAILED) {
+		*zero_copy = 1;
+		return buf;
+	}
+
+	*zero_copy = 0;
+	return malloc(len);
+}
+
+void usbfs_free(__attribute__((unused)) struct usbfs_dev *dev, void *buf,
+		size_t len, int zero_copy)
+{
+	if (zero_copy) {
+		munmap(buf, len);
+	} else {
+		free(buf);
+	}
+}
+
+void usbfs_fill_bulk(struct usbdevfs_urb *urb, uint8_t ep, void *buf,
+		size_t len)
+{
+	void *usercontext = urb->usercontext;
+
+	memset(urb, 0, sizeof(*urb));
+	urb->type = USBDEVFS_URB_TYPE_BULK;
+	urb->endpoint = ep;
+	urb->buffer = buf;
+	urb->buffer_length = len;
+	urb->usercontext = usercontext;
+}
+
+int usbfs_submit(struct usbfs_dev *dev, struct usbdevfs_urb *urb)
+{
+	if (ioctl(dev->fd, USBDEVFS_SUBMITURB, urb) == -1) {
+		return -errno;
+	}
+	return 0;
+}
+
+int usbfs_discard(struct usbfs_dev *dev, struct usbdevfs_urb *urb)
+{
+	if (ioctl(dev->fd, USBDEVFS_DISCARDURB, urb) == -1) {
+		return -errno;
+	}
+	return 0;
+}
+
+int usbfs_wait(struct usbfs_dev *dev, int timeout_ms)
+{
+	struct epoll_event ev;
+	int cnt;
+
+	cnt = epoll_wait(dev->epfd, &ev, 1, timeout_ms);
+	if (cnt == -1) {
+		return (errno == EINTR) ? 0 : -errno;
+	}
+	if (cnt == 0) {
+		return 0;
+	}
+	if (ev.events & (EPOLLHUP | EPOLLERR)) {
+		return -ENODEV;
+	}
+
+	return 1;
+}
+
+struct usbdevfs_urb *usbfs_reap(struct usbfs_dev *dev)
+{
+	struct usbdevfs_urb *urb = NULL;
+
+	if (ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &urb) == -1) {
+		return NULL;
+	}
+
+	return urb;
+}
@@ -0,0 +1,94 @@
+/**
+ * usbfs.h - Minimal asynchronous I/O on Linux usbfs, bypassing libusb
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __USBFS_H__
+#define __USBFS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/usbdevice_fs.h>
+
+/**
+ * Opened usbfs device
+ */
+struct usbfs_dev {
+	int fd;    // /dev/bus/usb/BBB/DDD
+	int epfd;  // epoll instance, signals reapable URBs
+	int ifnum; // Claimed interface
+};
+
+/**
+ * Open device by bus and device number and claim an interface
+ *
+ * @returns 0 on success, -errno on error
+ */
+int usbfs_open(struct usbfs_dev *dev, uint8_t bus, uint8_t addr, int ifnum);
+void usbfs_close(struct usbfs_dev *dev);
+
+/**
+ * Allocate a transfer buffer
+ *
+ * Buffers are mmap()'ed from usbfs when the kernel supports it, so the
+ * controller transfers directly from/to them without copying.
+ *
+ * @param zero_copy	Set to 1 if the buffer is mapped from usbfs, 0 if
+ *			it is a normal heap buffer
+ * @returns buffer, or NULL on error
+ */
+void *usbfs_alloc(struct usbfs_dev *dev, size_t len, int *zero_copy);
+void usbfs_free(struct usbfs_dev *dev, void *buf, size_t len, int zero_copy);
+
+/**
+ * Fill a bulk URB; usercontext is left to the caller
+ */
+void usbfs_fill_bulk(struct usbdevfs_urb *urb, uint8_t ep, void *buf,
+		size_t len);
+
+/**
+ * Submit URB
+ *
+ * @returns 0 on success, -errno on error
+ */
+int usbfs_submit(struct usbfs_dev *dev, struct usbdevfs_urb *urb);
+
+/**
+ * Cancel submitted URB; it still has to be reaped
+ */
+int usbfs_discard(struct usbfs_dev *dev, struct usbdevfs_urb *urb);
+
+/**
+ * Wait until URBs can be reaped
+ *
+ * @returns 1 if URBs can be reaped, 0 on timeout, -errno on error.
+ *          -ENODEV if the device is disconnected.
+ */
+int usbfs_wait(struct usbfs_dev *dev, int timeout_ms);
+
+/**
+ * Reap a completed URB without blocking
+ *
+ * @returns completed URB, or NULL if none left
+ */
+struct usbdevfs_urb *usbfs_reap(struct usbfs_dev *dev);
+
+#endif // __USBFS_H__
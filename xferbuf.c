@@ -0,0 +1,209 @@
+/**
+ * xferbuf.c - Hugepage backed, locked, NUMA local transfer buffers
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _DEFAULT_SOURCE
+
+#include "xferbuf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// From <numaif.h>, to not depend on libnuma
+#define MPOL_PREFERRED 1
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+
+int xferbuf_bus_node(uint8_t bus)
+{
+	char path[64];
+	FILE *fp;
+	int node = -1;
+
+	// The root hub's parent is the host controller's PCI device
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/usb%u/../numa_node",
+			bus);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	if (fscanf(fp, "%d", &node) != 1) {
+		node = -1;
+	}
+	fclose(fp);
+
+	return node;
+}
+
+/**
+ * Map size bytes aligned to a hugepage, so they can be backed by THP
+ */
+static void *map_aligned(size_t size)
+{
+	size_t map_size = size + XFERBUF_HUGEPAGE_SIZE;
+	uint8_t *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+
+	// Trim unaligned head and tail
+	uintptr_t aligned = ((uintptr_t) p + XFERBUF_HUGEPAGE_SIZE - 1) &
+				~((uintptr_t) XFERBUF_HUGEPAGE_SIZE - 1);
+	size_t head = aligned - (uintptr_t) p;
+	if (head != 0) {
+		munmap(p, head);
+	}
+	if (map_size - head - size != 0) {
+		munmap((uint8_t *) aligned + size, map_size - head - size);
+	}
+
+	return (void *) aligned;
+}
+
+/**
+ * Bytes of the mapping containing addr that are backed by transparent
+ * hugepages, from /proc/self/smaps
+ *
+ * @returns bytes, 0 if none or unknown
+ */
+static size_t thp_bytes(const void *addr)
+{
+	char line[256];
+	FILE *fp;
+	bool in_map = false;
+	size_t kb = 0;
+
+	fp = fopen("/proc/self/smaps", "r");
+	if (fp == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		unsigned long start, end;
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			// Mapping header
+			if (in_map) {
+				break;
+			}
+			in_map = ((uintptr_t) addr >= start && (uintptr_t) addr < end);
+		} else if (in_map && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(fp);
+
+	return kb * 1024;
+}
+
+int xferbuf_init(struct xferbuf_pool *pool, size_t size, int node)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->node = -1;
+
+	size = (size + XFERBUF_HUGEPAGE_SIZE - 1) & ~((size_t) XFERBUF_HUGEPAGE_SIZE - 1);
+	if (size == 0) {
+		size = XFERBUF_HUGEPAGE_SIZE;
+	}
+
+	// Reserved hugepages first, they are guaranteed; else ask for THP
+	pool->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (pool->base != MAP_FAILED) {
+		pool->pages = XFERBUF_PAGES_HUGETLB;
+	} else {
+		pool->base = map_aligned(size);
+		if (pool->base == NULL) {
+			perror("mmap()");
+			return -1;
+		}
+		pool->pages = XFERBUF_PAGES_NORMAL;
+		if (madvise(pool->base, size, MADV_HUGEPAGE) == 0) {
+			pool->pages = XFERBUF_PAGES_THP;
+		}
+	}
+	pool->size = size;
+
+	// Place before first touch, pages are allocated on fault
+	if (node >= 0 && node < (int) (sizeof(unsigned long) * 8)) {
+		unsigned long nodemask = 1ul << node;
+		syscall(SYS_mbind, pool->base, size, MPOL_PREFERRED,
+				&nodemask, sizeof(nodemask) * 8, 0);
+	}
+
+	// Pre-fault, and keep it resident
+	memset(pool->base, 0, size);
+	pool->locked = (mlock(pool->base, size) == 0);
+
+	// madvise() succeeds even if THP is disabled or none are available
+	if (pool->pages == XFERBUF_PAGES_THP && thp_bytes(pool->base) == 0) {
+		pool->pages = XFERBUF_PAGES_NORMAL;
+	}
+
+	int actual;
+	if (syscall(SYS_get_mempolicy, &actual, NULL, 0, pool->base,
+			MPOL_F_NODE | MPOL_F_ADDR) == 0)
+	{
+		pool->node = actual;
+	}
+
+	return 0;
+}
+
+void xferbuf_destroy(struct xferbuf_pool *pool)
+{
+	if (pool->base == NULL) {
+		return;
+	}
+	if (pool->locked) {
+		munlock(pool->base, pool->size);
+	}
+	munmap(pool->base, pool->size);
+	pool->base = NULL;
+}
+
+void *xferbuf_alloc(struct xferbuf_pool *pool, size_t len)
+{
+	size_t start = (pool->used + XFERBUF_ALIGN - 1) & ~((size_t) XFERBUF_ALIGN - 1);
+
+	if (start + len > pool->size) {
+		return NULL;
+	}
+	pool->used = start + len;
+
+	return pool->base + start;
+}
+
+const char *xferbuf_pages_name(enum xferbuf_pages pages)
+{
+	switch (pages) {
+	case XFERBUF_PAGES_HUGETLB:
+		return "hugepages";
+	case XFERBUF_PAGES_THP:
+		return "transparent hugepages";
+	default:
+		return "base pages";
+	}
+}
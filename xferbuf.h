@@ -0,0 +1,86 @@
+/**
+ * xferbuf.h - Hugepage backed, locked, NUMA local transfer buffers
+ *
+ * Copyright (c) 2020 David Imhoff <dimhoff.devel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __XFERBUF_H__
+#define __XFERBUF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define XFERBUF_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define XFERBUF_ALIGN 64 // Alignment of buffers within the pool
+
+/**
+ * Pages backing a pool
+ */
+enum xferbuf_pages {
+	XFERBUF_PAGES_NORMAL = 0, // Base pages
+	XFERBUF_PAGES_THP,        // Transparent hugepages
+	XFERBUF_PAGES_HUGETLB,    // Reserved hugepages
+};
+
+/**
+ * Pool of buffers carved from a single mapping
+ *
+ * The mapping is placed on a NUMA node, pre-faulted and locked at creation,
+ * so no page faults happen while a test runs.
+ */
+struct xferbuf_pool {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	enum xferbuf_pages pages;
+	bool locked;
+	int node; // NUMA node the memory is on, -1 if unknown
+};
+
+/**
+ * NUMA node of the host controller of a USB bus, read from sysfs
+ *
+ * @returns node, or -1 if unknown or not a NUMA system
+ */
+int xferbuf_bus_node(uint8_t bus);
+
+/**
+ * Create pool of at least size bytes
+ *
+ * Hugepages, locking and NUMA placement are best effort; what was achieved
+ * is recorded in the pool.
+ *
+ * @param node	NUMA node to place memory on, -1 for any
+ * @returns 0 on success, -1 on error
+ */
+int xferbuf_init(struct xferbuf_pool *pool, size_t size, int node);
+void xferbuf_destroy(struct xferbuf_pool *pool);
+
+/**
+ * Take buffer from pool
+ *
+ * @returns buffer, or NULL if the pool is exhausted
+ */
+void *xferbuf_alloc(struct xferbuf_pool *pool, size_t len);
+
+const char *xferbuf_pages_name(enum xferbuf_pages pages);
+
+#endif // __XFERBUF_H__